@@ -24,38 +24,56 @@
 #include "sys.h"
 #include "AIAuxiliaryThread.h"
 #include "AIEngine.h"
+#include "AIStatefulTask.h"
 #include "debug.h"
 
 namespace {
 SingletonInstance<AIAuxiliaryThread> dummy __attribute__ ((__unused__));
+// 1 + the index of the engine that is run by this thread, or 0 if this isn't an auxiliary thread.
+thread_local int t_engine_index = 0;
 }
 
-void AIAuxiliaryThread::mainloop()
+void AIAuxiliaryThread::mainloop(AIEngine* engine, int index)
 {
   // Start of a new thread. Turn on debug output.
   Debug(NAMESPACE_DEBUG::init_thread());
-  DoutEntering(dc::statefultask, "AIAuxiliaryThread::mainloop()");
+  DoutEntering(dc::statefultask, "AIAuxiliaryThread::mainloop() [" << engine->name() << "]");
   AIAuxiliaryThread& auxiliary_thread(instance());
+  t_engine_index = index + 1;
   while(*keep_running_type::crat(auxiliary_thread.m_keep_running))
   {
-    gAuxiliaryThreadEngine.mainloop();
+    engine->mainloop();
   }
-  *stopped_type::wat(auxiliary_thread.m_stopped) = true;
+  --*running_threads_type::wat(auxiliary_thread.m_running_threads);
 }
 
-void AIAuxiliaryThread::start()
+void AIAuxiliaryThread::start(int number_of_threads, policy_type policy)
 {
-  DoutEntering(dc::statefultask, "AIAuxiliaryThread::start()");
+  DoutEntering(dc::statefultask, "AIAuxiliaryThread::start(" << number_of_threads << ")");
+  ASSERT(1 <= number_of_threads && number_of_threads <= max_number_of_engines);
   AIAuxiliaryThread& auxiliary_thread(instance());
   {
-    stopped_type::wat stopped_w(auxiliary_thread.m_stopped);
-    if (!*stopped_w)
+    running_threads_type::wat running_threads_w(auxiliary_thread.m_running_threads);
+    if (*running_threads_w)
       return;
-    *stopped_w = false;
+    *running_threads_w = number_of_threads;
   }
   *keep_running_type::wat(auxiliary_thread.m_keep_running) = true;
-  std::thread new_thread_handle(mainloop);
-  auxiliary_thread.m_handle.swap(new_thread_handle);
+  // Create the engines that we don't have yet. Engines are never destroyed, because tasks might still refer to them.
+  auxiliary_thread.m_engines[0] = &gAuxiliaryThreadEngine;
+  if (auxiliary_thread.m_number_of_created_engines == 0)
+    auxiliary_thread.m_number_of_created_engines = 1;
+  while (auxiliary_thread.m_number_of_created_engines < number_of_threads)
+  {
+    auxiliary_thread.m_engine_names.push_back("gAuxiliaryThreadEngine" + std::to_string(auxiliary_thread.m_number_of_created_engines));
+    auxiliary_thread.m_engines[auxiliary_thread.m_number_of_created_engines++] = new AIEngine(auxiliary_thread.m_engine_names.back().c_str());
+  }
+  auxiliary_thread.m_handles.clear();
+  for (int i = 0; i < number_of_threads; ++i)
+    auxiliary_thread.m_handles.emplace_back(mainloop, auxiliary_thread.m_engines[i], i);
+  auxiliary_thread.m_policy = policy;
+  // Publish the engines to engine_for().
+  auxiliary_thread.m_number_of_engines.store(number_of_threads, std::memory_order_release);
 }
 
 void AIAuxiliaryThread::stop()
@@ -68,16 +86,88 @@ void AIAuxiliaryThread::stop()
       return;
     *keep_running_w = false;
   }
-  gAuxiliaryThreadEngine.wake_up();
+  int const number_of_threads = auxiliary_thread.m_handles.size();
+  // From now on tasks go to gAuxiliaryThreadEngine again.
+  auxiliary_thread.m_number_of_engines.store(0, std::memory_order_relaxed);
+  for (int i = 0; i < number_of_threads; ++i)
+    auxiliary_thread.m_engines[i]->wake_up();
   bool stopped;
   int count = 401;
-  while(!(stopped = *stopped_type::crat(auxiliary_thread.m_stopped)) && --count)
+  while(!(stopped = *running_threads_type::crat(auxiliary_thread.m_running_threads) == 0) && --count)
   {
     std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    // A thread that was between testing m_keep_running and parking in its engine missed the wake up; wake it up again.
+    for (int i = 0; i < number_of_threads; ++i)
+      auxiliary_thread.m_engines[i]->wake_up();
   }
+  for (std::thread& handle : auxiliary_thread.m_handles)
+  {
+    if (stopped)
+      handle.join();
+    else
+      handle.detach();
+  }
+  auxiliary_thread.m_handles.clear();
+  // Move the tasks that are still queued in the additional engines to gAuxiliaryThreadEngine, which
+  // runs again after the next start() no matter how many threads that starts (see engine_for()).
   if (stopped)
-    auxiliary_thread.m_handle.join();
-  else
-    auxiliary_thread.m_handle.detach();
-  Dout(dc::notice, "Stateful task thread" << (!stopped ? " not" : "") << " stopped after " << ((400 - count) * 10) << "ms.");
+    for (int i = 1; i < number_of_threads; ++i)
+      auxiliary_thread.m_engines[i]->hand_over(&gAuxiliaryThreadEngine);
+  Dout(dc::notice, "Stateful task thread" << (number_of_threads > 1 ? "s" : "") << (!stopped ? " not" : "") << " stopped after " << ((400 - count) * 10) << "ms.");
+}
+
+//static
+AIEngine* AIAuxiliaryThread::engine_for(AIStatefulTask* stateful_task)
+{
+  AIAuxiliaryThread& auxiliary_thread(instance());
+  int const number_of_engines = auxiliary_thread.m_number_of_engines.load(std::memory_order_acquire);
+  if (number_of_engines <= 1)
+    return &gAuxiliaryThreadEngine;
+  if (auxiliary_thread.m_policy == stable_hash)
+  {
+    // Tasks are allocated with new, so the lower bits are all the same; mix the bits with a multiplicative hash.
+    uint64_t hash = (reinterpret_cast<uintptr_t>(stateful_task) >> 4) * 0x9E3779B97F4A7C15ULL;
+    return auxiliary_thread.m_engines[(hash >> 32) % number_of_engines];
+  }
+  int const affine_index = stateful_task->mAffinity - 1;        // -1 when the task wasn't added to one of our engines before.
+  uint64_t affine_length = 0;
+  if (auxiliary_thread.m_policy == affinity && 0 <= affine_index && affine_index < number_of_engines)
+  {
+    affine_length = auxiliary_thread.m_engines[affine_index]->queue_length();
+    // Don't bother to look at the other engines if they can't be shorter by enough.
+    if (affine_length <= affinity_max_imbalance)
+      return auxiliary_thread.m_engines[affine_index];
+  }
+  // least_loaded.
+  int index = 0;
+  uint64_t shortest = auxiliary_thread.m_engines[0]->queue_length();
+  for (int i = 1; i < number_of_engines && shortest > 0; ++i)
+  {
+    uint64_t length = auxiliary_thread.m_engines[i]->queue_length();
+    if (length < shortest)
+    {
+      shortest = length;
+      index = i;
+    }
+  }
+  if (auxiliary_thread.m_policy == affinity)
+  {
+    if (0 <= affine_index && affine_index < number_of_engines && affine_length <= shortest + affinity_max_imbalance)
+      index = affine_index;
+    stateful_task->mAffinity = index + 1;
+  }
+  return auxiliary_thread.m_engines[index];
+}
+
+//static
+AIEngine* AIAuxiliaryThread::resume_engine(AIStatefulTask* stateful_task)
+{
+  if (AI_LIKELY(stateful_task->mAffinity == 0) || stateful_task->mAffinity == t_engine_index)
+    return nullptr;
+  AIAuxiliaryThread& auxiliary_thread(instance());
+  // Stopped, or restarted with fewer threads or another policy.
+  int const number_of_engines = auxiliary_thread.m_number_of_engines.load(std::memory_order_acquire);
+  if (stateful_task->mAffinity > number_of_engines || auxiliary_thread.m_policy != affinity)
+    return nullptr;
+  return engine_for(stateful_task);
 }
@@ -25,26 +25,89 @@
 
 #include "utils/Singleton.h"
 #include "threadsafe/aithreadsafe.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
 
+class AIEngine;
+class AIStatefulTask;
+
+// The auxiliary threads run the engines that tasks end up in when they need
+// to run from an engine but don't have one (ie, they have a null default engine
+// and called yield()).
+//
+// By default there is one such thread, running gAuxiliaryThreadEngine.
+// Passing a larger number to start() creates additional engines, each
+// with their own thread; engine_for() then spreads tasks over all of them,
+// so that unrelated background tasks don't queue up behind each other.
+//
+// With the affinity policy a task keeps returning to the thread that it was
+// last added to, so that its data stays in the cache of that core. This includes
+// being signalled by another thread (for example, a thread pool worker): instead
+// of running in the thread that called signal(), the task is then added to its
+// own engine again (see resume_engine()).
+//
+// That extra hand-off is not free: it costs a wake-up of the auxiliary thread and
+// a context switch where the task would otherwise just have continued. Only use the
+// affinity policy when the data a task touches per run is large and there are enough
+// cores for the auxiliary threads to run in parallel with the threads that signal the
+// tasks. On a machine with a single CPU there is no cache to preserve and affinity only
+// costs: in tests/benchmark_auxiliary_affinity (8 tasks touching 64 kB each, 4 auxiliary
+// threads, 2 signalling threads) least_loaded took 152 ms and affinity 302 ms. There is
+// no measurement of the cache misses that affinity saves on a multi-core machine yet.
+// Compare the llc_misses per state of AIPerfCounters before turning it on; it is never the default.
+//
 class AIAuxiliaryThread : public Singleton<AIAuxiliaryThread> {
     friend_Instance;
+  public:
+    // How engine_for() chooses an engine.
+    enum policy_type {
+      stable_hash,              // Hash the address of the task; a task always ends up in the same engine.
+      least_loaded,             // Use the engine with the shortest queue.
+      affinity                  // Use the engine that the task was last added to, unless its queue is much longer than the shortest one.
+                                // Costs an extra hand-off per signal; see above before using it.
+    };
+
+    static constexpr int max_number_of_engines = 64;
+    // The affinity policy moves a task to the engine with the shortest queue when the queue of its own engine is this much longer.
+    static constexpr uint64_t affinity_max_imbalance = 8;
+
   private:
     // MAIN-THREAD
-    AIAuxiliaryThread() : m_keep_running(false), m_stopped(true) { }
+    AIAuxiliaryThread() : m_number_of_created_engines(0), m_number_of_engines(0), m_policy(stable_hash), m_keep_running(false), m_running_threads(0) { }
     ~AIAuxiliaryThread() { }
     AIAuxiliaryThread(AIAuxiliaryThread const&) : Singleton<AIAuxiliaryThread>() { }
 
   private:
-    std::thread m_handle;
+    std::vector<std::thread> m_handles;
+    AIEngine* m_engines[max_number_of_engines];         // m_engines[0] is &gAuxiliaryThreadEngine, the rest is created by start().
+    std::deque<std::string> m_engine_names;             // The names of the engines that were created by start().
+    int m_number_of_created_engines;                    // The number of engines in m_engines that have been initialized.
+    std::atomic<int> m_number_of_engines;               // The number of engines in use by engine_for(); zero while stopped.
+    policy_type m_policy;
     using keep_running_type = aithreadsafe::Wrapper<bool, aithreadsafe::policy::Primitive<std::mutex>>;
     keep_running_type m_keep_running;
-    using stopped_type = aithreadsafe::Wrapper<bool, aithreadsafe::policy::Primitive<std::mutex>>;
-    stopped_type m_stopped;
+    using running_threads_type = aithreadsafe::Wrapper<int, aithreadsafe::policy::Primitive<std::mutex>>;
+    running_threads_type m_running_threads;
 
   public:
-    static void start();
+    // Start number_of_threads auxiliary threads, each running its own engine.
+    static void start(int number_of_threads = 1, policy_type policy = stable_hash);
+    // Stop all threads. Tasks that are still queued in the additional engines are moved to gAuxiliaryThreadEngine.
     static void stop();
 
+    // Return the engine that stateful_task should run in when it has no engine of its own.
+    // This is gAuxiliaryThreadEngine when only one thread was started (or when not running).
+    static AIEngine* engine_for(AIStatefulTask* stateful_task);
+
+    // Return the engine that stateful_task, which has no engine of its own, should be added to instead of
+    // continuing to run in the current thread. This is nullptr unless the policy is affinity and
+    // the task was added to one of our engines before, by engine_for(), and that engine is run by another thread.
+    static AIEngine* resume_engine(AIStatefulTask* stateful_task);
+
   private:
-    static void mainloop();
+    static void mainloop(AIEngine* engine, int index);
 };
@@ -0,0 +1,155 @@
+/**
+ * @file
+ * @brief Declaration of AICompletionCallback, a move-only small buffer callable for the call back of a stateful task.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+#pragma once
+
+#include <new>
+#include <utility>
+#include <cstddef>
+#include <type_traits>
+
+// A move-only callable with signature void(bool) that stores small callables inline.
+//
+// This is what AIStatefulTask uses to store the call back that is passed to run().
+// Unlike boost::signals2 it supports only a single target, takes no locks and doesn't
+// allocate memory unless the callable is larger than buffer_size bytes (or can throw
+// while being moved), in which case it is stored on the heap.
+//
+class AICompletionCallback
+{
+  public:
+    static size_t const buffer_size = 3 * sizeof(void*);        // Large enough for a lambda that captures three pointers or references.
+
+  private:
+    using storage_type = typename std::aligned_storage<buffer_size, alignof(std::max_align_t)>::type;
+    using invoke_type = void (*)(storage_type& storage, bool success);
+    using destroy_type = void (*)(storage_type& storage);
+    using move_type = void (*)(storage_type& to, storage_type& from);   // Move construct `to' from `from' and destroy `from'.
+
+    struct vtable_st {
+      invoke_type invoke;
+      destroy_type destroy;
+      move_type move;
+    };
+
+    template<typename F>
+    struct Inline {
+      static F& get(storage_type& storage) { return *reinterpret_cast<F*>(&storage); }
+      static void invoke(storage_type& storage, bool success) { get(storage)(success); }
+      static void destroy(storage_type& storage) { get(storage).~F(); }
+      static void move(storage_type& to, storage_type& from) { new (&to) F(std::move(get(from))); get(from).~F(); }
+      static vtable_st const vtable;
+    };
+
+    template<typename F>
+    struct Heap {
+      static F*& get(storage_type& storage) { return *reinterpret_cast<F**>(&storage); }
+      static void invoke(storage_type& storage, bool success) { (*get(storage))(success); }
+      static void destroy(storage_type& storage) { delete get(storage); }
+      static void move(storage_type& to, storage_type& from) { new (&to) F*(get(from)); }
+      static vtable_st const vtable;
+    };
+
+    template<typename F>
+    struct fits_inline : std::integral_constant<bool,
+        sizeof(F) <= buffer_size && alignof(std::max_align_t) % alignof(F) == 0 && std::is_nothrow_move_constructible<F>::value> { };
+
+    storage_type m_storage;
+    vtable_st const* m_vtable;          // nullptr when empty.
+
+    template<typename F>
+    void construct(F&& f, std::true_type)
+    {
+      using functor_type = typename std::decay<F>::type;
+      new (&m_storage) functor_type(std::forward<F>(f));
+      m_vtable = &Inline<functor_type>::vtable;
+    }
+
+    template<typename F>
+    void construct(F&& f, std::false_type)
+    {
+      using functor_type = typename std::decay<F>::type;
+      new (&m_storage) functor_type*(new functor_type(std::forward<F>(f)));
+      m_vtable = &Heap<functor_type>::vtable;
+    }
+
+  public:
+    AICompletionCallback() : m_vtable(nullptr) { }
+    AICompletionCallback(std::nullptr_t) : m_vtable(nullptr) { }
+
+    template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, AICompletionCallback>::value>::type>
+    AICompletionCallback(F&& f) { construct(std::forward<F>(f), fits_inline<typename std::decay<F>::type>()); }
+
+    AICompletionCallback(AICompletionCallback&& other) : m_vtable(other.m_vtable)
+    {
+      if (m_vtable)
+      {
+        m_vtable->move(m_storage, other.m_storage);
+        other.m_vtable = nullptr;
+      }
+    }
+
+    AICompletionCallback& operator=(AICompletionCallback&& other)
+    {
+      if (this != &other)
+      {
+        reset();
+        if (other.m_vtable)
+        {
+          other.m_vtable->move(m_storage, other.m_storage);
+          m_vtable = other.m_vtable;
+          other.m_vtable = nullptr;
+        }
+      }
+      return *this;
+    }
+
+    AICompletionCallback& operator=(std::nullptr_t) { reset(); return *this; }
+
+    AICompletionCallback(AICompletionCallback const&) = delete;
+    AICompletionCallback& operator=(AICompletionCallback const&) = delete;
+
+    ~AICompletionCallback() { reset(); }
+
+    void reset()
+    {
+      if (m_vtable)
+      {
+        m_vtable->destroy(m_storage);
+        m_vtable = nullptr;
+      }
+    }
+
+    explicit operator bool() const { return m_vtable; }
+
+    void operator()(bool success) { m_vtable->invoke(m_storage, success); }
+};
+
+template<typename F>
+AICompletionCallback::vtable_st const AICompletionCallback::Inline<F>::vtable = { &Inline<F>::invoke, &Inline<F>::destroy, &Inline<F>::move };
+
+template<typename F>
+AICompletionCallback::vtable_st const AICompletionCallback::Heap<F>::vtable = { &Heap<F>::invoke, &Heap<F>::destroy, &Heap<F>::move };
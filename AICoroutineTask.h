@@ -0,0 +1,388 @@
+/**
+ * @file
+ * @brief Coroutine front-end for stateful tasks. Declaration of class AICoroutineTask.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#pragma once
+
+// Coroutines need C++20; the rest of the library is C++11.
+// When this header is included from a translation unit that is compiled without
+// coroutine support then it doesn't define anything.
+#if defined(__has_include)
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#define AI_HAVE_COROUTINE_TASK 1
+#endif
+#endif
+
+#ifdef AI_HAVE_COROUTINE_TASK
+
+#include "AIStatefulTask.h"
+#include "AIPackagedTask.h"
+#include "AISlabAllocator.h"
+#include "utils/macros.h"
+#include <coroutine>
+#include <exception>
+
+#ifdef EXAMPLE_CODE     // undefined
+
+int factorial(int n)
+{
+  int r = 1;
+  while(n > 1) r *= n--;
+  return r;
+}
+
+class Task : public AICoroutineTask {
+  protected:
+    ~Task() override { }                                // The destructor must be protected.
+
+    // The body of the task.
+    coroutine run_coroutine() override;
+
+  public:
+    Task() : AICoroutineTask(DEBUG_ONLY(true)),
+        m_calculate_factorial(this, 1, &factorial, queue_handle) { }
+
+  private:
+    AIPackagedTask<int(int)> m_calculate_factorial;
+};
+
+AICoroutineTask::coroutine Task::run_coroutine()
+{
+  m_calculate_factorial(5);                             // "Call the function" -- this just copies the argument(s) to be passed to the executing thread.
+  int result = co_await job(m_calculate_factorial);     // Execute `factorial' in the thread pool and continue here once it finished.
+  co_await switch_to(&gMainThreadEngine);               // Continue running from the main thread engine.
+  std::cout << "The factorial of 5 = " << result << std::endl;
+  if (!co_await child(new OtherTask, 2))                // Run a child task and continue here once it finished.
+  {
+    abort();                                            // The child was aborted; abort this task too.
+    co_return;                                          // abort() doesn't leave the coroutine.
+  }
+  co_await wait_for(4);                                 // Wait until some other thread calls signal(4).
+}                                                       // Falling off the end (or co_return) calls finish().
+#endif // EXAMPLE_CODE
+
+// A stateful task whose states are written as a single coroutine.
+//
+// Instead of overriding multiplex_impl(), a derived class overrides run_coroutine().
+// Every co_await on one of the awaitables below maps onto the corresponding
+// AIStatefulTask call, and the coroutine is resumed from multiplex_impl()
+// once the task runs again:
+//
+//   co_await wait_for(conditions)      wait(conditions); resumes after signal(conditions).
+//   co_await switch_to(engine)         yield_if_not(engine), or target(engine) when already running in engine.
+//   co_await yield_now()               yield().
+//   co_await child(task, condition)    task->run(this, condition, signal_parent) followed by wait(condition); returns false if the child aborted.
+//   co_await job(packaged_task)        packaged_task.dispatch(), retried after a yield() while the queue is full; returns packaged_task.get().
+//
+// An AIPackagedTask passed to job() must have been constructed with this task as parent.
+//
+// Falling off the end of the coroutine (or co_return) calls finish(), unless abort()
+// was called before. An exception that leaves the coroutine aborts the task.
+// When the task is aborted while the coroutine is suspended, the coroutine frame
+// is destroyed (and with it all its local variables) before abort_impl() returns.
+//
+// Coroutine frames are allocated from a small set of slab allocators (see AISlabAllocator),
+// so that starting a task doesn't cost a call to the global allocator.
+//
+class AICoroutineTask : public AIStatefulTask
+{
+  protected:
+    using direct_base_type = AIStatefulTask;
+
+    // The different states of the task.
+    enum coroutine_task_state_type {
+      AICoroutineTask_start = direct_base_type::max_state,      // run_coroutine() wasn't called yet.
+      AICoroutineTask_resume,                                   // The coroutine is suspended.
+      AICoroutineTask_dispatched                                // The coroutine is suspended on a job that was dispatched.
+    };
+
+  public:
+    static state_type const max_state = AICoroutineTask_dispatched + 1;
+
+  private:
+    // Coroutine frames are allocated from one of a few slab allocators, by size.
+    struct frame_pool
+    {
+      static constexpr size_t smallest = 128;
+      static constexpr int size_classes = 5;            // 128, 256, 512, 1024 and 2048 bytes.
+
+      // Returns size_classes if size is too large for the largest size class.
+      static int size_class(size_t size)
+      {
+        int sc = 0;
+        while (sc < size_classes && size > (smallest << sc))
+          ++sc;
+        return sc;
+      }
+
+      static AISlabAllocator& allocator(int sc)
+      {
+        // Constructed on first use and never destructed, because frames might be freed by threads that exit during static destruction.
+        // Every slab is 8 kB.
+        static AISlabAllocator* allocators[size_classes] = {
+          new AISlabAllocator(smallest, 64), new AISlabAllocator(smallest << 1, 32), new AISlabAllocator(smallest << 2, 16),
+          new AISlabAllocator(smallest << 3, 8), new AISlabAllocator(smallest << 4, 4)
+        };
+        return *allocators[sc];
+      }
+
+      static void* allocate(size_t size)
+      {
+        int const sc = size_class(size);
+        if (AI_UNLIKELY(sc == size_classes))
+          return ::operator new(size);
+        static thread_local AISlabAllocator::ThreadCache thread_caches[size_classes] = {
+          allocator(0), allocator(1), allocator(2), allocator(3), allocator(4)
+        };
+        return allocator(sc).allocate(thread_caches[sc]);
+      }
+
+      static void deallocate(void* ptr, size_t size)
+      {
+        if (AI_UNLIKELY(size_class(size) == size_classes))
+          ::operator delete(ptr, size);
+        else
+          AISlabAllocator::deallocate(ptr);
+      }
+    };
+
+  public:
+    // The return type of run_coroutine().
+    class coroutine
+    {
+      public:
+        struct promise_type
+        {
+          std::exception_ptr m_exception;               // Set when an exception left the coroutine.
+
+          coroutine get_return_object() { return coroutine(std::coroutine_handle<promise_type>::from_promise(*this)); }
+          std::suspend_always initial_suspend() noexcept { return {}; }         // The coroutine is only ever run from multiplex_impl().
+          std::suspend_always final_suspend() noexcept { return {}; }           // The frame is destroyed by the task.
+          void return_void() { }
+          void unhandled_exception() { m_exception = std::current_exception(); }
+
+          static void* operator new(size_t size) { return frame_pool::allocate(size); }
+          static void operator delete(void* ptr, size_t size) { frame_pool::deallocate(ptr, size); }
+        };
+
+      private:
+        friend class AICoroutineTask;
+        std::coroutine_handle<promise_type> m_handle;
+        explicit coroutine(std::coroutine_handle<promise_type> handle) : m_handle(handle) { }
+    };
+
+  private:
+    std::coroutine_handle<coroutine::promise_type> m_handle;    // The coroutine, while it exists.
+    void (*m_pending)(void*);                                   // If set, called (once) by the next run instead of resuming the coroutine.
+    void* m_pending_context;                                    // The argument passed to m_pending.
+
+  protected:
+    // co_await wait_for(conditions);
+    class condition_awaiter
+    {
+      private:
+        AICoroutineTask* m_task;
+        condition_type m_conditions;
+
+      public:
+        condition_awaiter(AICoroutineTask* task, condition_type conditions) : m_task(task), m_conditions(conditions) { }
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>) { m_task->wait(m_conditions); }
+        void await_resume() const noexcept { }
+    };
+
+    // co_await switch_to(engine);
+    class engine_awaiter
+    {
+      private:
+        AICoroutineTask* m_task;
+        AIEngine* m_engine;
+
+      public:
+        engine_awaiter(AICoroutineTask* task, AIEngine* engine) : m_task(task), m_engine(engine) { }
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<>)
+        {
+          if (m_task->yield_if_not(m_engine))
+            return true;                                // Continue in m_engine.
+          m_task->target(m_engine);                     // Already running in m_engine (or m_engine is nullptr); just stay there.
+          return false;
+        }
+        void await_resume() const noexcept { }
+    };
+
+    // co_await yield_now();
+    class yield_awaiter
+    {
+      private:
+        AICoroutineTask* m_task;
+
+      public:
+        explicit yield_awaiter(AICoroutineTask* task) : m_task(task) { }
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>) { m_task->yield(); }
+        void await_resume() const noexcept { }
+    };
+
+    // bool success = co_await child(task, condition);
+    class child_awaiter
+    {
+      private:
+        AICoroutineTask* m_task;
+        boost::intrusive_ptr<AIStatefulTask> m_child;   // Keep the child alive until we resumed.
+        condition_type m_condition;
+        AIEngine* m_default_engine;
+
+      public:
+        child_awaiter(AICoroutineTask* task, AIStatefulTask* child, condition_type condition, AIEngine* default_engine) :
+            m_task(task), m_child(child), m_condition(condition), m_default_engine(default_engine) { }
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>)
+        {
+          m_child->run(m_task, m_condition, signal_parent, m_default_engine);
+          m_task->wait(m_condition);
+        }
+        bool await_resume() const { return !m_child->aborted(); }
+    };
+
+    // R result = co_await job(packaged_task);
+    template<typename R, typename ...Args>
+    class job_awaiter
+    {
+      private:
+        AICoroutineTask* m_task;
+        AIPackagedTask<R(Args...)>& m_packaged_task;
+
+        // Like the dispatch() / yield() / set_state() sequence of a switch based task.
+        void dispatch()
+        {
+          if (!m_packaged_task.dispatch())
+          {
+            // The queue is full; try again after a yield.
+            m_task->m_pending = &job_awaiter::retry;
+            m_task->m_pending_context = this;
+            m_task->yield();
+            return;
+          }
+          // If the job already finished then dispatch() didn't call wait(); the state change makes sure we run again.
+          m_task->set_state(AICoroutineTask_dispatched);
+        }
+
+        static void retry(void* self) { static_cast<job_awaiter*>(self)->dispatch(); }
+
+      public:
+        job_awaiter(AICoroutineTask* task, AIPackagedTask<R(Args...)>& packaged_task) : m_task(task), m_packaged_task(packaged_task) { }
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>) { dispatch(); }
+        R await_resume() const { return m_packaged_task.get(); }
+    };
+
+    condition_awaiter wait_for(condition_type conditions) { return condition_awaiter(this, conditions); }
+    engine_awaiter switch_to(AIEngine* engine) { return engine_awaiter(this, engine); }
+    yield_awaiter yield_now() { return yield_awaiter(this); }
+    child_awaiter child(AIStatefulTask* task, condition_type condition, AIEngine* default_engine = &gMainThreadEngine) { return child_awaiter(this, task, condition, default_engine); }
+    template<typename R, typename ...Args>
+    job_awaiter<R, Args...> job(AIPackagedTask<R(Args...)>& packaged_task) { return job_awaiter<R, Args...>(this, packaged_task); }
+
+  public:
+    AICoroutineTask(DEBUG_ONLY(bool debug = false)) : AIStatefulTask(DEBUG_ONLY(debug)), m_pending(nullptr), m_pending_context(nullptr) { }
+
+  protected:
+    ~AICoroutineTask() override { destroy_coroutine(); }
+
+    // The body of the task. Called once per run(), from the first call to multiplex_impl().
+    virtual coroutine run_coroutine() = 0;
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch(run_state)
+      {
+        AI_CASE_RETURN(AICoroutineTask_start);
+        AI_CASE_RETURN(AICoroutineTask_resume);
+        AI_CASE_RETURN(AICoroutineTask_dispatched);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    // A derived class that overrides initialize_impl() or abort_impl() must call these.
+    void initialize_impl() override
+    {
+      destroy_coroutine();                              // In case of a restart from the call back.
+      set_state(AICoroutineTask_start);
+    }
+
+    void abort_impl() override { destroy_coroutine(); }
+
+    void multiplex_impl(state_type run_state) override final
+    {
+      switch(run_state)
+      {
+        case AICoroutineTask_start:
+          m_handle = run_coroutine().m_handle;
+          set_state(AICoroutineTask_resume);
+          break;
+        case AICoroutineTask_dispatched:
+          set_state(AICoroutineTask_resume);
+          break;
+        case AICoroutineTask_resume:
+          if (m_pending)
+          {
+            void (*pending)(void*) = m_pending;
+            m_pending = nullptr;
+            pending(m_pending_context);
+            return;
+          }
+          break;
+      }
+      m_handle.resume();
+      if (m_handle.done())
+      {
+        bool const threw = static_cast<bool>(m_handle.promise().m_exception);
+        destroy_coroutine();
+        if (threw)
+        {
+          Dout(dc::warning, "An exception left AICoroutineTask::run_coroutine(); aborting task " << (void*)this << ".");
+          abort();
+        }
+        else if (!aborted())
+          finish();
+      }
+    }
+
+  private:
+    void destroy_coroutine()
+    {
+      if (m_handle)
+      {
+        m_handle.destroy();
+        m_handle = nullptr;
+      }
+      m_pending = nullptr;
+    }
+};
+
+#endif // AI_HAVE_COROUTINE_TASK
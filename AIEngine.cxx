@@ -36,78 +36,391 @@
 
 #include "sys.h"
 #include "AIEngine.h"
+#include "AITrace.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
 
 AIEngine gMainThreadEngine("gMainThreadEngine");
 AIEngine gAuxiliaryThreadEngine("gAuxiliaryThreadEngine");
 
+AIEngine::~AIEngine()
+{
+  if (mEpollFd != -1)
+  {
+    close(mEpollFd);
+    close(mEventFd);
+  }
+}
+
 void AIEngine::add(AIStatefulTask* stateful_task)
 {
+  if (AI_UNLIKELY(Batch::add(this, stateful_task)))
+    return;
   Dout(dc::statefultask(stateful_task->mSMDebug), "Adding stateful task [" << (void*)stateful_task << "] to " << mName);
+  bool const foreign = std::this_thread::get_id() != mMainloopThreadId.load(std::memory_order_relaxed);
+  AITrace::engine_event(AITrace::engine_add, stateful_task, mName);
   engine_state_type::wat engine_state_w(mEngineState);
-  engine_state_w->list.push_back(QueueElement(stateful_task));
+  engine_state_w->insert(QueueElement(stateful_task));
+  update_queue_length(engine_state_w->list.size());
+  if (foreign)
+    mForeignAdds.fetch_add(1, std::memory_order_relaxed);
   if (engine_state_w->waiting)
   {
-    engine_state_w.signal();
+    if (mEpollFd == -1)
+      engine_state_w.signal();
+    else
+      notify_eventfd();
+  }
+}
+
+void AIEngine::add(queued_type& stateful_tasks)
+{
+  Dout(dc::statefultask, "Adding " << stateful_tasks.size() << " stateful tasks to " << mName);
+  bool const foreign = std::this_thread::get_id() != mMainloopThreadId.load(std::memory_order_relaxed);
+  size_t const count = stateful_tasks.size();
+  if (AITrace::enabled())
+    for (QueueElement const& queued : stateful_tasks)
+      AITrace::engine_event(AITrace::engine_add, &queued.stateful_task(), mName);
+  engine_state_type::wat engine_state_w(mEngineState);
+  engine_state_w->splice(stateful_tasks);
+  update_queue_length(engine_state_w->list.size());
+  if (foreign)
+    mForeignAdds.fetch_add(count, std::memory_order_relaxed);
+  if (engine_state_w->waiting)
+  {
+    if (mEpollFd == -1)
+      engine_state_w.signal();
+    else
+      notify_eventfd();
+  }
+}
+
+void AIEngine::engine_state_st::insert(QueueElement&& queued)
+{
+  int const priority = queued.priority();
+  queued_type::iterator const pos = class_end[priority];
+  queued_type::iterator const element = list.insert(pos, std::move(queued));
+  // If there are no elements of a class between a higher class and this one, then this element is also the end of that higher class.
+  for (int c = 0; c < priority; ++c)
+    if (class_end[c] == pos)
+      class_end[c] = element;
+  // If mainloop() is running a task of a lower class, then this task was added in front of it.
+  if (priority < next_priority)
+    preempt = true;
+}
+
+void AIEngine::engine_state_st::splice(queued_type& stateful_tasks)
+{
+  while (!stateful_tasks.empty())
+  {
+    insert(std::move(stateful_tasks.front()));
+    stateful_tasks.pop_front();
+  }
+}
+
+AIEngine::queued_type::iterator AIEngine::engine_state_st::erase(queued_type::iterator queued)
+{
+  queued_type::iterator const next = std::next(queued);
+  for (int c = 0; c < AIStatefulTask::number_of_priorities; ++c)
+    if (class_end[c] == queued)
+      class_end[c] = next;
+  list.erase(queued);
+  return next;
+}
+
+void AIEngine::engine_state_st::clear()
+{
+  list.clear();
+  for (int c = 0; c < AIStatefulTask::number_of_priorities; ++c)
+    class_end[c] = list.end();
+}
+
+void AIEngine::engine_state_st::sort()
+{
+  list.sort(QueueElementComp());
+  queued_type::iterator queued = list.begin();
+  for (int c = 0; c < AIStatefulTask::number_of_priorities; ++c)
+  {
+    while (queued != list.end() && queued->priority() <= c)
+      ++queued;
+    class_end[c] = queued;
+  }
+}
+
+void AIEngine::QueueElement::age(bool reached)
+{
+  if (reached)
+  {
+    // Back to the priority of the task (which might have been changed in the meantime).
+    mPriority = mStatefulTask->priority();
+    mSkipped = 0;
+  }
+  else if (++mSkipped >= sAgingFrames && mPriority > AIStatefulTask::high_priority)
+  {
+    --mPriority;
+    mSkipped = 0;
   }
 }
 
+namespace {
+thread_local AIEngine::Batch* t_batch;          // The inner most batch of this thread, or nullptr.
+} // namespace
+
+AIEngine::Batch::Batch() : m_outer(t_batch)
+{
+  t_batch = this;
+}
+
+AIEngine::Batch::~Batch()
+{
+  t_batch = m_outer;
+  // Hand everything to the outer batch, or add the tasks to their engines when this is the outer most batch.
+  for (auto& queue : m_queues)
+  {
+    if (m_outer)
+    {
+      queued_type& outer_queue(m_outer->queue_for(queue.first));
+      outer_queue.splice(outer_queue.end(), queue.second);
+    }
+    else
+      queue.first->add(queue.second);
+  }
+}
+
+AIEngine::queued_type& AIEngine::Batch::queue_for(AIEngine* engine)
+{
+  // There are usually only one or two engines involved, so a linear search is the fastest.
+  for (auto& queue : m_queues)
+    if (queue.first == engine)
+      return queue.second;
+  m_queues.emplace_back(engine, queued_type());
+  return m_queues.back().second;
+}
+
+//static
+bool AIEngine::Batch::add(AIEngine* engine, AIStatefulTask* stateful_task)
+{
+  Batch* batch = t_batch;
+  if (!batch)
+    return false;
+  Dout(dc::statefultask(stateful_task->mSMDebug), "Adding stateful task [" << (void*)stateful_task << "] to batch for " << engine->name());
+  batch->queue_for(engine).emplace_back(stateful_task);
+  return true;
+}
+
+// Called while mEngineState is locked.
+void AIEngine::update_queue_length(size_t length)
+{
+  mQueueLength.store(length, std::memory_order_relaxed);
+  if (length > mQueueHighWater.load(std::memory_order_relaxed))
+    mQueueHighWater.store(length, std::memory_order_relaxed);
+}
+
 void AIEngine::mainloop()
 {
   bool const main_thread = this == &gMainThreadEngine;
+  mMainloopThreadId.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  duration_type const budget = main_thread ? begin_frame(clock_type::now()) : duration_type::zero();
   queued_type::iterator queued_element, end;
+  bool idle;
+  clock_type::time_point park_start;
   {
     engine_state_type::wat engine_state_w(mEngineState);
     end = engine_state_w->list.end();
     queued_element = engine_state_w->list.begin();
-    if (queued_element == end)
+    idle = queued_element == end;
+    // We start at the front of the queue anyway.
+    engine_state_w->preempt = false;
+    engine_state_w->next_priority = idle ? AIStatefulTask::number_of_priorities : queued_element->priority();
+    if (idle && !main_thread)
     {
       // Nothing to do. Wait till something is added to the queue again.
-      if (!main_thread)
+      park_start = clock_type::now();
+      engine_state_w->waiting = true;
+      if (mEpollFd == -1)
       {
-        engine_state_w->waiting = true;
         engine_state_w.wait();
         engine_state_w->waiting = false;
+        mParkedDuration.fetch_add((clock_type::now() - park_start).count(), std::memory_order_relaxed);
+        return;
       }
-      return;
+      // In epoll mode, release the lock on mEngineState and wait in epoll_wait() below.
+    }
+  }
+  if (mEpollFd != -1)
+  {
+    // Block until a file descriptor becomes ready or until add() or wake_up() wrote to mEventFd
+    // (which might already have happened, in which case epoll_wait() returns immediately).
+    // If there are tasks to run (or this is the main thread) then only pick up the file
+    // descriptors that are already ready.
+    bool const block = idle && !main_thread;
+    poll_fds(block ? -1 : 0);
+    if (block)
+    {
+      engine_state_type::wat(mEngineState)->waiting = false;
+      mParkedDuration.fetch_add((clock_type::now() - park_start).count(), std::memory_order_relaxed);
     }
   }
+  if (idle)
+    return;
   duration_type total_duration(duration_type::zero());
+  bool const adaptive = main_thread && sAdaptiveTarget != duration_type::zero();
+  uint64_t tasks_run = 0;
+  int preemptions = 0;
   do
   {
     AIStatefulTask& stateful_task(queued_element->stateful_task());
-    if (main_thread)
+    if (adaptive && tasks_run > 0 &&
+        total_duration.count() + mTaskCostMean + 2 * mTaskCostDeviation > budget.count())
     {
-      clock_type::time_point start = clock_type::now();
-      if (!stateful_task.sleep(start))
-        stateful_task.multiplex(AIStatefulTask::normal_run, this);
-      clock_type::duration delta = clock_type::now() - start;
-      stateful_task.add(delta);
-      total_duration += delta;
+      // The next task is expected to exceed the budget of this frame; stop before running it.
+      engine_state_type::wat engine_state_w(mEngineState);
+      if (engine_state_w->list.size() > 2)
+      {
+        Dout(dc::statefultask, "Sorting " << engine_state_w->list.size() << " stateful tasks.");
+        age_and_sort(*engine_state_w, queued_element);
+        mResorts.fetch_add(1, std::memory_order_relaxed);
+      }
+      break;
     }
-    else
+    clock_type::time_point start = clock_type::now();
+    bool const sleeping = main_thread && stateful_task.sleep(start);
+    if (!sleeping)
     {
+      mRunStart = start;
       stateful_task.multiplex(AIStatefulTask::normal_run, this);
     }
+    clock_type::duration delta = clock_type::now() - start;
+    stateful_task.add(delta);
+    if (main_thread)
+    {
+      total_duration += delta;
+      if (!sleeping)
+        update_task_cost(delta);
+    }
+    // Only this thread writes mMultiplexDuration; the per task class counters are kept by AITaskAccounting (see task_class_statistics()).
+    mMultiplexDuration.store(mMultiplexDuration.load(std::memory_order_relaxed) + delta.count(), std::memory_order_relaxed);
+    ++tasks_run;
 
-    bool active = stateful_task.active(this);   // This locks mState shortly, so it must be called before locking mEngineState because add() locks mEngineState while holding mState.
+    bool active = stateful_task.active(this);   // This is a single atomic load; it doesn't lock the task.
     engine_state_type::wat engine_state_w(mEngineState);
     if (!active)
     {
       Dout(dc::statefultask(stateful_task.mSMDebug), "Erasing stateful task [" << (void*)&stateful_task << "] from " << mName);
-      engine_state_w->list.erase(queued_element++);
+      AITrace::engine_event(AITrace::engine_remove, &stateful_task, mName);
+      queued_element = engine_state_w->erase(queued_element);
+      update_queue_length(engine_state_w->list.size());
     }
     else
     {
       ++queued_element;
     }
-    if (main_thread && total_duration >= sMaxDuration && engine_state_w->list.size() > 2)
+    if (AI_UNLIKELY(engine_state_w->preempt))
+    {
+      // A task of a higher class than the one we just ran was added; run it first.
+      engine_state_w->preempt = false;
+      if (preemptions < sMaxPreemptions)
+      {
+        ++preemptions;
+        queued_element = engine_state_w->list.begin();
+        mPreemptions.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    engine_state_w->next_priority = queued_element != end ? queued_element->priority() : AIStatefulTask::number_of_priorities;
+    if (main_thread && !adaptive && total_duration >= sMaxDuration && engine_state_w->list.size() > 2)
     {
       Dout(dc::statefultask, "Sorting " << engine_state_w->list.size() << " stateful tasks.");
-      engine_state_w->list.sort(QueueElementComp());
+      age_and_sort(*engine_state_w, queued_element);
+      mResorts.fetch_add(1, std::memory_order_relaxed);
       break;
     }
   }
   while (queued_element != end);
+  mLoops.fetch_add(1, std::memory_order_relaxed);
+  mTasksRun.fetch_add(tasks_run, std::memory_order_relaxed);
+  if (tasks_run > mMaxTasksPerLoop.load(std::memory_order_relaxed))
+    mMaxTasksPerLoop.store(tasks_run, std::memory_order_relaxed);
+  // A budget of zero means that no budget was set.
+  if (main_thread && budget != duration_type::zero() && total_duration > budget)
+  {
+    mBudgetViolations.fetch_add(1, std::memory_order_relaxed);
+    mBudgetOvershoot.fetch_add((total_duration - budget).count(), std::memory_order_relaxed);
+  }
+}
+
+// Called by the main thread, with mEngineState locked, when it ran out of budget before running not_reached.
+// Let the tasks that weren't run this frame age and sort the queue.
+void AIEngine::age_and_sort(engine_state_st& engine_state, queued_type::iterator not_reached)
+{
+  bool reached = true;
+  for (queued_type::iterator queued = engine_state.list.begin(); queued != engine_state.list.end(); ++queued)
+  {
+    if (queued == not_reached)
+      reached = false;
+    queued->age(reached);
+  }
+  engine_state.sort();
+}
+
+// Called by the main thread at the start of every frame. Returns the budget for this frame.
+AIEngine::duration_type AIEngine::begin_frame(clock_type::time_point now)
+{
+  mFrames.fetch_add(1, std::memory_order_relaxed);
+  if (mLastFrameStart != clock_type::time_point())
+  {
+    double frame_duration = (now - mLastFrameStart).count();
+    mFrameDuration = mFrameDuration == 0 ? frame_duration : mFrameDuration + (frame_duration - mFrameDuration) / 16;
+  }
+  mLastFrameStart = now;
+  duration_type budget = sMaxDuration;
+  if (sAdaptiveTarget != duration_type::zero())
+  {
+    budget = sAdaptiveTarget;
+    if (sFrameFraction > 0 && mFrameDuration > 0)
+    {
+      duration_type frame_budget(static_cast<duration_type::rep>(sFrameFraction * mFrameDuration));
+      if (frame_budget < budget)
+        budget = frame_budget;
+    }
+  }
+  mBudget.store(budget.count(), std::memory_order_relaxed);
+  return budget;
+}
+
+// Called by the main thread after running a task. Keep track of the distribution of the cost of a single task run.
+void AIEngine::update_task_cost(duration_type delta)
+{
+  double cost = delta.count();
+  double deviation = cost > mTaskCostMean ? cost - mTaskCostMean : mTaskCostMean - cost;
+  mTaskCostMean += (cost - mTaskCostMean) / 16;
+  mTaskCostDeviation += (deviation - mTaskCostDeviation) / 16;
+}
+
+AIEngine::statistics_st AIEngine::statistics() const
+{
+  statistics_st statistics;
+  statistics.loops = mLoops.load(std::memory_order_relaxed);
+  statistics.tasks_run = mTasksRun.load(std::memory_order_relaxed);
+  statistics.max_tasks_per_loop = mMaxTasksPerLoop.load(std::memory_order_relaxed);
+  statistics.queue_length = mQueueLength.load(std::memory_order_relaxed);
+  statistics.queue_high_water = mQueueHighWater.load(std::memory_order_relaxed);
+  statistics.multiplex_duration = duration_type(mMultiplexDuration.load(std::memory_order_relaxed));
+  statistics.parked_duration = duration_type(mParkedDuration.load(std::memory_order_relaxed));
+  statistics.resorts = mResorts.load(std::memory_order_relaxed);
+  statistics.foreign_adds = mForeignAdds.load(std::memory_order_relaxed);
+  statistics.preemptions = mPreemptions.load(std::memory_order_relaxed);
+  statistics.run_budget_yields = mRunBudgetYields.load(std::memory_order_relaxed);
+  statistics.frames = mFrames.load(std::memory_order_relaxed);
+  statistics.budget_violations = mBudgetViolations.load(std::memory_order_relaxed);
+  statistics.budget_overshoot = duration_type(mBudgetOvershoot.load(std::memory_order_relaxed));
+  statistics.budget = duration_type(mBudget.load(std::memory_order_relaxed));
+  // mFrameDuration is a double that is only written by the main thread; this read is racy
+  // but at worst returns a slightly stale value.
+  statistics.frame_duration = duration_type(static_cast<duration_type::rep>(mFrameDuration));
+  return statistics;
 }
 
 void AIEngine::flush()
@@ -119,11 +432,42 @@ void AIEngine::flush()
     // To avoid an assertion in ~AIStatefulTask.
     iter->stateful_task().force_killed();
   }
-  engine_state_w->list.clear();
+  engine_state_w->clear();
+  update_queue_length(0);
+}
+
+void AIEngine::hand_over(AIEngine* engine)
+{
+  queued_type stateful_tasks;
+  {
+    engine_state_type::wat engine_state_w(mEngineState);
+    DoutEntering(dc::statefultask, "AIEngine::hand_over(" << engine->mName << ") [" << mName << "]: moving " << engine_state_w->list.size() << " stateful tasks.");
+    for (QueueElement& queued : engine_state_w->list)
+    {
+      // Only tasks that still want to run in this engine; the others would have been removed by mainloop().
+      AIEngine* expected = this;
+      if (queued.stateful_task().mCurrentEngine.compare_exchange_strong(expected, engine, std::memory_order_acq_rel, std::memory_order_relaxed))
+        stateful_tasks.emplace_back(&queued.stateful_task());
+    }
+    engine_state_w->clear();
+    update_queue_length(0);
+  }
+  if (!stateful_tasks.empty())
+    engine->add(stateful_tasks);
 }
 
 // static
 AIEngine::duration_type AIEngine::sMaxDuration;
+std::atomic<uint32_t> AIEngine::sNextSerial(AITaskAccounting::no_engine);
+AIEngine::duration_type AIEngine::sAdaptiveTarget;
+float AIEngine::sFrameFraction;
+
+void AIEngine::set_run_budget(unsigned int max_runs, duration_type max_duration)
+{
+  Dout(dc::statefultask, "AIEngine::set_run_budget(" << max_runs << ", " << std::chrono::duration_cast<std::chrono::microseconds>(max_duration).count() << " us) [" << mName << "]");
+  mMaxRuns.store(max_runs, std::memory_order_relaxed);
+  mMaxRunDuration.store(max_duration.count(), std::memory_order_relaxed);
+}
 
 // static
 void AIEngine::setMaxDuration(float max_duration)
@@ -133,16 +477,136 @@ void AIEngine::setMaxDuration(float max_duration)
   sMaxDuration = std::chrono::duration_cast<duration_type>(std::chrono::duration<float, std::milli>(max_duration));
 }
 
+// static
+void AIEngine::setAdaptiveMaxDuration(float target_duration, float frame_fraction)
+{
+  ASSERT(aithreadid::in_main_thread());
+  Dout(dc::statefultask, "AIEngine::setAdaptiveMaxDuration(" << target_duration << ", " << frame_fraction << ")");
+  sAdaptiveTarget = std::chrono::duration_cast<duration_type>(std::chrono::duration<float, std::milli>(target_duration));
+  sFrameFraction = frame_fraction;
+}
+
 void AIEngine::wake_up()
 {
   engine_state_type::wat engine_state_w(mEngineState);
   if (engine_state_w->waiting)
   {
-    engine_state_w.signal();
+    if (mEpollFd == -1)
+      engine_state_w.signal();
+    else
+      notify_eventfd();
+  }
+}
+
+bool AIEngine::enable_fd_readiness()
+{
+  DoutEntering(dc::statefultask, "AIEngine::enable_fd_readiness() [" << mName << "]");
+  // Only call this once.
+  ASSERT(mEpollFd == -1);
+  mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (mEventFd == -1)
+  {
+    Dout(dc::warning, "eventfd: " << std::strerror(errno));
+    return false;
+  }
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = mEventFd;
+  if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mEventFd, &event) == -1)
+  {
+    Dout(dc::warning, "epoll: " << std::strerror(errno));
+    if (epoll_fd != -1)
+      close(epoll_fd);
+    close(mEventFd);
+    mEventFd = -1;
+    return false;
+  }
+  mEpollFd = epoll_fd;
+  return true;
+}
+
+bool AIEngine::watch_fd(int fd, uint32_t events, AIStatefulTask* stateful_task, AIStatefulTask::condition_type condition)
+{
+  Dout(dc::statefultask(stateful_task->mSMDebug), "Watching fd " << fd << " for stateful task [" << (void*)stateful_task << "] in " << mName);
+  // Call enable_fd_readiness() first.
+  ASSERT(mEpollFd != -1);
+  struct epoll_event event;
+  event.events = events | EPOLLONESHOT;
+  event.data.fd = fd;
+  fd_watches_type::wat fd_watches_w(mFdWatches);
+  auto result = fd_watches_w->insert(fd_watches_container_type::value_type(fd, fd_watch_st()));
+  fd_watch_st& fd_watch(result.first->second);
+  fd_watch.stateful_task = stateful_task;
+  fd_watch.condition = condition;
+  // The first time use EPOLL_CTL_ADD, after that the fd stays in the interest list (disarmed) until unwatch_fd is called.
+  if (epoll_ctl(mEpollFd, result.second ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) == -1)
+  {
+    Dout(dc::warning, "epoll_ctl(" << fd << "): " << std::strerror(errno));
+    fd_watches_w->erase(result.first);
+    return false;
+  }
+  return true;
+}
+
+void AIEngine::unwatch_fd(int fd)
+{
+  Dout(dc::statefultask, "Unwatching fd " << fd << " in " << mName);
+  boost::intrusive_ptr<AIStatefulTask> stateful_task;   // Release the reference after unlocking mFdWatches.
+  fd_watches_type::wat fd_watches_w(mFdWatches);
+  auto iter = fd_watches_w->find(fd);
+  if (iter == fd_watches_w->end())
+    return;
+  epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+  stateful_task.swap(iter->second.stateful_task);
+  fd_watches_w->erase(iter);
+}
+
+// Called while mEngineState is locked.
+void AIEngine::notify_eventfd()
+{
+  uint64_t one = 1;
+  // This can only fail when the counter overflows, which is impossible because mainloop() resets it.
+  ssize_t len __attribute__ ((__unused__)) = write(mEventFd, &one, sizeof(one));
+}
+
+// Wait at most timeout_ms milliseconds (or forever when -1) for file descriptors to become ready and signal their tasks.
+void AIEngine::poll_fds(int timeout_ms)
+{
+  constexpr int max_events = 32;
+  struct epoll_event events[max_events];
+  int ready;
+  do
+  {
+    ready = epoll_wait(mEpollFd, events, max_events, timeout_ms);
+  }
+  while (ready == -1 && errno == EINTR);
+  for (int i = 0; i < ready; ++i)
+  {
+    int fd = events[i].data.fd;
+    if (fd == mEventFd)
+    {
+      uint64_t count;
+      ssize_t len __attribute__ ((__unused__)) = read(mEventFd, &count, sizeof(count));
+      continue;
+    }
+    boost::intrusive_ptr<AIStatefulTask> stateful_task;
+    AIStatefulTask::condition_type condition;
+    {
+      fd_watches_type::wat fd_watches_w(mFdWatches);
+      auto iter = fd_watches_w->find(fd);
+      if (iter == fd_watches_w->end())          // Raced with unwatch_fd.
+        continue;
+      stateful_task.swap(iter->second.stateful_task);
+      condition = iter->second.condition;
+    }
+    // This is the direct hand-off: no other thread is involved.
+    if (stateful_task)
+      stateful_task->signal(condition);
   }
 }
 
 bool AIEngine::QueueElementComp::operator()(QueueElement const& e1, QueueElement const& e2) const
 {
-  return e1.mStatefulTask->getDuration() < e2.mStatefulTask->getDuration();
+  return e1.mPriority < e2.mPriority || (e1.mPriority == e2.mPriority && e1.mStatefulTask->getDuration() < e2.mStatefulTask->getDuration());
 }
@@ -39,9 +39,16 @@
 #include "threadsafe/aithreadsafe.h"
 #include "threadsafe/Condition.h"
 #include "AIStatefulTask.h"
+#include "AITaskAccounting.h"
 #include "debug.h"
 #include <list>
+#include <map>
+#include <atomic>
 #include <chrono>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <cstdint>
 #include <boost/intrusive_ptr.hpp>
 
 class AIEngine
@@ -51,15 +58,19 @@ class AIEngine
     class QueueElement {
       private:
         boost::intrusive_ptr<AIStatefulTask> mStatefulTask;
+        uint8_t mPriority;              // The priority class that the task is queued with; the priority of the task, or higher when aged.
+        uint8_t mSkipped;               // The number of consecutive frames that gMainThreadEngine didn't get to this task.
 
       public:
-        QueueElement(AIStatefulTask* stateful_task) : mStatefulTask(stateful_task) { }
+        QueueElement(AIStatefulTask* stateful_task) : mStatefulTask(stateful_task), mPriority(stateful_task->priority()), mSkipped(0) { }
         friend bool operator==(QueueElement const& e1, QueueElement const& e2) { return e1.mStatefulTask == e2.mStatefulTask; }
         friend bool operator!=(QueueElement const& e1, QueueElement const& e2) { return e1.mStatefulTask != e2.mStatefulTask; }
         friend struct QueueElementComp;
 
         AIStatefulTask const& stateful_task() const { return *mStatefulTask; }
         AIStatefulTask& stateful_task() { return *mStatefulTask; }
+        int priority() const { return mPriority; }
+        void age(bool reached);         // Called for every task in the queue of gMainThreadEngine when it is sorted.
     };
     struct QueueElementComp {
       inline bool operator()(QueueElement const& e1, QueueElement const& e2) const;
@@ -67,31 +78,233 @@ class AIEngine
 
   public:
     using queued_type = std::list<QueueElement>;
+    // The queue is ordered by priority class; tasks of the same class are kept in the order in which they were added.
     struct engine_state_st {
       queued_type list;
+      queued_type::iterator class_end[AIStatefulTask::number_of_priorities];    // For each class, the first element of a lower class (or list.end()).
+      int next_priority;                // The class of the task that mainloop() is about to run, or number_of_priorities.
+      bool preempt;                     // Set when a task was added in front of the task that mainloop() is about to run.
       bool waiting;
-      engine_state_st() : waiting(false) { }
+      engine_state_st() : next_priority(AIStatefulTask::number_of_priorities), preempt(false), waiting(false) { clear(); }
+
+      void insert(QueueElement&& queued);                               // Add queued at the end of its class.
+      void splice(queued_type& stateful_tasks);                         // Same, for all elements of stateful_tasks.
+      queued_type::iterator erase(queued_type::iterator queued);        // Remove queued and return the next element.
+      void clear();                                                     // Remove all elements.
+      void sort();                                                      // Sort by priority class and then by time spent, lowest first.
     };
 
     using clock_type = AIStatefulTask::clock_type;
     using duration_type = AIStatefulTask::duration_type;
 
+    // A snapshot of the runtime counters of an engine, as returned by statistics().
+    struct statistics_st {
+      uint64_t loops;                   // Number of calls to mainloop() that found at least one task in the queue.
+      uint64_t tasks_run;               // Total number of tasks run by mainloop() (sum over all loops).
+      uint64_t max_tasks_per_loop;      // The largest number of tasks that were run during a single loop.
+      uint64_t queue_length;            // Current number of tasks in the queue.
+      uint64_t queue_high_water;        // The largest number of tasks that were ever in the queue at the same time.
+      duration_type multiplex_duration; // Total time spent in multiplex().
+      duration_type parked_duration;    // Total time spent waiting for a task to be added while the queue was empty.
+      uint64_t resorts;                 // Number of times the queue was sorted because sMaxDuration was exceeded.
+      uint64_t foreign_adds;            // Number of tasks added by a thread other than the one running mainloop().
+      uint64_t preemptions;             // Number of times mainloop() went back to the start of the queue for a task of a higher priority class.
+      uint64_t run_budget_yields;       // Number of times a task was put back in the queue because it used up the run budget (see set_run_budget()).
+      // Frame budget (gMainThreadEngine only).
+      uint64_t frames;                  // Number of calls to mainloop().
+      uint64_t budget_violations;       // Number of frames in which more time than the budget was spent in multiplex() (only counted while a budget is set).
+      duration_type budget_overshoot;   // Total time spent in multiplex() beyond the budget.
+      duration_type budget;             // The current per frame budget.
+      duration_type frame_duration;     // The (moving average of the) measured time between two calls to mainloop().
+    };
+
+    // A file descriptor that a task is waiting on (see watch_fd()).
+    struct fd_watch_st {
+      boost::intrusive_ptr<AIStatefulTask> stateful_task;       // The task to signal, or nullptr when the watch already fired.
+      AIStatefulTask::condition_type condition;                 // The condition to signal the task with.
+    };
+    using fd_watches_container_type = std::map<int, fd_watch_st>;
+
+    // Collect the tasks that are added to an engine by the current thread while an object of this type exists,
+    // and add them to their engines at once (with one lock per engine) when it is destructed.
+    //
+    // This doesn't change anything else: every call to run() still resets the task and
+    // decides in which engine it should run; only the insertion into the queue of
+    // that engine is postponed till the end of the scope. Therefore, don't wait for
+    // any of those tasks to do something before the Batch is destructed.
+    //
+    // Typical usage, for example from multiplex_impl():
+    //
+    //   {
+    //     AIEngine::Batch batch;
+    //     for (int i = 0; i < 10000; ++i)
+    //       (new MyChild(i))->run(this, 1, signal_parent, &gAuxiliaryThreadEngine);
+    //   } // All children are added to gAuxiliaryThreadEngine here.
+    //
+    // Batches may be nested; the tasks are then added to their engines at the end of the outer most batch.
+    class Batch {
+      private:
+        Batch* m_outer;                                         // The enclosing batch of this thread, if any.
+        std::vector<std::pair<AIEngine*, queued_type>> m_queues;        // The collected tasks, per engine.
+
+      public:
+        Batch();
+        ~Batch();
+        Batch(Batch const&) = delete;
+
+      private:
+        friend class AIEngine;
+        static bool add(AIEngine* engine, AIStatefulTask* stateful_task);       // Add stateful_task to the current batch of this thread, if any.
+        queued_type& queue_for(AIEngine* engine);                               // Return the collected tasks for engine.
+    };
+
   private:
     using engine_state_type = aithreadsafe::Wrapper<engine_state_st, aithreadsafe::policy::Primitive<aithreadsafe::Condition>>;
     engine_state_type mEngineState;
     char const* mName;
+    uint32_t const mSerial;                             // Unique for every engine ever created; the key of this engine in AITaskAccounting.
+    static std::atomic<uint32_t> sNextSerial;
     static duration_type sMaxDuration;
+    static duration_type sAdaptiveTarget;       // Target per frame budget when in adaptive mode, or zero when not in adaptive mode.
+    static float sFrameFraction;                // The maximum fraction of the frame duration to use in adaptive mode, or zero.
+    static int const sMaxPreemptions = 8;       // The maximum number of times per call that mainloop() starts over for a task of a higher class.
+    static int const sAgingFrames = 4;          // The number of frames that a task may be skipped by gMainThreadEngine before it moves up a class.
+
+    // Run budget (see set_run_budget()).
+    std::atomic<unsigned int> mMaxRuns;                 // The maximum number of consecutive runs of a task per call to multiplex(), or zero.
+    std::atomic<duration_type::rep> mMaxRunDuration;    // The maximum time that a task may keep running per call to multiplex(), or zero.
+    clock_type::time_point mRunStart;                   // The time at which mainloop() last called multiplex(). Only accessed by the thread running mainloop().
+
+    // Frame budget administration (gMainThreadEngine only; only accessed by the main thread).
+    clock_type::time_point mLastFrameStart;     // The time at which mainloop() was called the previous time.
+    double mFrameDuration;                      // Moving average of the time between two calls to mainloop(), in clock ticks.
+    double mTaskCostMean;                       // Moving average of the time spent in a single call to multiplex(), in clock ticks.
+    double mTaskCostDeviation;                  // Moving average of the absolute deviation from mTaskCostMean, in clock ticks.
+
+    // File descriptor readiness (only used after a call to enable_fd_readiness()).
+    int mEpollFd;                       // The epoll instance, or -1 when this engine waits on a condition variable.
+    int mEventFd;                       // Used by add() and wake_up() to wake up epoll_wait() (only valid when mEpollFd != -1).
+    using fd_watches_type = aithreadsafe::Wrapper<fd_watches_container_type, aithreadsafe::policy::Primitive<std::mutex>>;
+    fd_watches_type mFdWatches;
+
+    // Statistics.
+    //
+    // These are only written by the thread running mainloop() (except for mQueueLength, mQueueHighWater and mForeignAdds
+    // which are updated by add() while mEngineState is locked) and read with relaxed loads by statistics(), so that
+    // polling them doesn't disturb the engine.
+    std::atomic<std::thread::id> mMainloopThreadId;     // The thread that last called mainloop().
+    std::atomic<uint64_t> mLoops;
+    std::atomic<uint64_t> mTasksRun;
+    std::atomic<uint64_t> mMaxTasksPerLoop;
+    std::atomic<uint64_t> mQueueLength;
+    std::atomic<uint64_t> mQueueHighWater;
+    std::atomic<duration_type::rep> mMultiplexDuration;
+    std::atomic<duration_type::rep> mParkedDuration;
+    std::atomic<uint64_t> mResorts;
+    std::atomic<uint64_t> mForeignAdds;
+    std::atomic<uint64_t> mPreemptions;
+    std::atomic<uint64_t> mRunBudgetYields;
+    std::atomic<uint64_t> mFrames;
+    std::atomic<uint64_t> mBudgetViolations;
+    std::atomic<duration_type::rep> mBudgetOvershoot;
+    std::atomic<duration_type::rep> mBudget;
 
   public:
-    AIEngine(char const* name) : mName(name) { }
+    AIEngine(char const* name) : mName(name), mSerial(++sNextSerial), mMaxRuns(0), mMaxRunDuration(0), mFrameDuration(0), mTaskCostMean(0), mTaskCostDeviation(0), mEpollFd(-1), mEventFd(-1),
+        mMainloopThreadId(std::thread::id()), mLoops(0), mTasksRun(0), mMaxTasksPerLoop(0), mQueueLength(0), mQueueHighWater(0),
+        mMultiplexDuration(0), mParkedDuration(0), mResorts(0), mForeignAdds(0), mPreemptions(0), mRunBudgetYields(0), mFrames(0), mBudgetViolations(0), mBudgetOvershoot(0), mBudget(0) { }
+    ~AIEngine();
 
+    // Add stateful_task to the queue, behind the tasks with the same or a higher priority class (see AIStatefulTask::set_priority()).
     void add(AIStatefulTask* stateful_task);
 
+    // Run all tasks in the queue once, those of a higher priority class first. When a task of a higher class than
+    // the current one is added while mainloop() runs, it starts over at the front of the queue (at most sMaxPreemptions
+    // times per call, so that the tasks of lower classes still get their turn). gMainThreadEngine stops when the frame
+    // budget is used up; a task that it didn't get to in sAgingFrames consecutive frames moves up one class.
     void mainloop();
     void wake_up();
     void flush();
 
+    // Move all tasks in the queue to the queue of engine, so that they don't get stranded in an engine that isn't run anymore.
+    // May only be called while no thread is running mainloop() (see AIAuxiliaryThread::stop()).
+    void hand_over(AIEngine* engine);
+
+    // Let this engine wait on epoll instead of a condition variable while its queue is empty,
+    // so that it can signal tasks directly when a file descriptor becomes ready (see watch_fd).
+    // Must be called before mainloop() is called for the first time. Returns false on failure.
+    bool enable_fd_readiness();
+
+    // Signal stateful_task with condition once when fd becomes ready for any of the epoll events in `events' (ie, EPOLLIN).
+    // The watch is one-shot: call watch_fd again to re-arm it. The engine keeps a reference to the task
+    // until the watch fires or unwatch_fd is called. Returns false on failure (ie, fd doesn't support epoll).
+    //
+    // Typical usage from multiplex_impl():
+    //
+    //   case MyTask_wait_for_data:
+    //     gAuxiliaryThreadEngine.watch_fd(m_socket, EPOLLIN, this, 1);
+    //     set_state(MyTask_read_data);
+    //     wait(1);
+    //     break;
+    //
+    bool watch_fd(int fd, uint32_t events, AIStatefulTask* stateful_task, AIStatefulTask::condition_type condition);
+
+    // Stop watching fd. Must be called before closing fd (and from abort_impl() of a task that might be waiting on it).
+    void unwatch_fd(int fd);
+
     char const* name() const { return mName; }
 
+    // Return the serial number of this engine; never AITaskAccounting::no_engine, and never reused (unlike the address of an engine).
+    uint32_t serial() const { return mSerial; }
+
+    // Return a snapshot of the runtime counters of this engine. This is cheap and may be called by any thread at any time.
+    statistics_st statistics() const;
+
+    // Return the current number of tasks in the queue. Cheap; may be called by any thread.
+    uint64_t queue_length() const { return mQueueLength.load(std::memory_order_relaxed); }
+
+    // Return the runs per task class (the most derived type of the task) that were done by this engine, summed over
+    // all threads that ran it. The counters are kept per thread by AITaskAccounting, so this takes a few locks but
+    // never slows down the engine; it is cheap enough to poll every second. The pool_* fields are always zero here.
+    AITaskAccounting::container_type task_class_statistics() const { return AITaskAccounting::totals(mSerial); }
+
+    // Limit the time that a single task can keep the thread of this engine busy.
+    //
+    // A task that keeps setting new states without calling yield() or wait() is run over and over
+    // by the same call to multiplex(). With a run budget, multiplex() puts it back in the queue of
+    // this engine, as if it called yield(), after max_runs consecutive runs or once max_duration was spent
+    // on it, so that the other tasks in the queue get their turn. Zero means no limit (the default).
+    void set_run_budget(unsigned int max_runs, duration_type max_duration = duration_type::zero());
+
+    // Called by multiplex() between two consecutive runs of a task that was run by mainloop(), after `runs' runs.
+    // Returns true (and counts a run_budget_yields) if the task should be put back in the queue.
+    bool run_budget_exceeded(unsigned int runs)
+    {
+      unsigned int const max_runs = mMaxRuns.load(std::memory_order_relaxed);
+      duration_type::rep const max_duration = mMaxRunDuration.load(std::memory_order_relaxed);
+      if (AI_LIKELY(max_runs == 0 && max_duration == 0))
+        return false;
+      bool const exceeded = (max_runs != 0 && runs >= max_runs) || (max_duration != 0 && (clock_type::now() - mRunStart).count() >= max_duration);
+      if (exceeded)
+        mRunBudgetYields.store(mRunBudgetYields.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return exceeded;
+    }
+
+    // Set the fixed per frame budget of gMainThreadEngine: stop running tasks after max_duration milliseconds were spent.
     static void setMaxDuration(float max_duration);
+
+    // Switch gMainThreadEngine to an adaptive per frame budget of target_duration milliseconds, limited to
+    // frame_fraction times the measured frame duration when frame_fraction is non-zero. Instead of stopping
+    // after going over the budget, the engine stops before running a task that is expected to exceed it,
+    // based on the observed distribution of the time spent per task. Pass zero to return to setMaxDuration().
+    static void setAdaptiveMaxDuration(float target_duration, float frame_fraction = 0.0f);
+
+  private:
+    void add(queued_type& stateful_tasks);      // Add all stateful_tasks at once (called by Batch).
+    void update_queue_length(size_t length);
+    void notify_eventfd();
+    void poll_fds(int timeout_ms);
+    duration_type begin_frame(clock_type::time_point now);
+    void age_and_sort(engine_state_st& engine_state, queued_type::iterator not_reached);
+    void update_task_cost(duration_type delta);
 };
@@ -62,6 +62,8 @@ class AIFriendOfStatefulTask {
     void wait(condition_type conditions) { m_parent_task->wait(conditions); }
     void wait_until(AIWaitConditionFunc const& wait_condition, condition_type conditions) { m_parent_task->wait_until(wait_condition, conditions); }
     void wait_until(AIWaitConditionFunc const& wait_condition, condition_type conditions, state_type new_state) { m_parent_task->set_state(new_state); m_parent_task->wait_until(wait_condition, conditions); }
+    void wait_until(AIWaitConditionPtr wait_condition, void* context, condition_type conditions) { m_parent_task->wait_until(wait_condition, context, conditions); }
+    void wait_until(AIWaitConditionPtr wait_condition, void* context, condition_type conditions, state_type new_state) { m_parent_task->set_state(new_state); m_parent_task->wait_until(wait_condition, context, conditions); }
     void finish() { m_parent_task->finish(); }
     void yield() { m_parent_task->yield(); }
     void target(AIEngine* engine) { m_parent_task->target(engine); }
@@ -119,6 +119,11 @@ class AIObjectQueue {
 
   int capacity(void) const { return m_capacity; }
 
+  // Return true when the queue is empty. This doesn't lock anything, so the answer
+  // can be out of date by the time it is used; but it allows a consumer to skip
+  // an empty queue without taking the consumer lock.
+  bool empty() const { return m_tail.load(std::memory_order_relaxed) == m_head.load(std::memory_order_relaxed); }
+
  private:
   void allocate_(int objects)
   {
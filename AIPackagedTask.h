@@ -33,6 +33,8 @@
 #include "AIDelayedFunction.h"
 #include "AIObjectQueue.h"
 #include "AIThreadPool.h"
+#include "AITaskAccounting.h"
+#include "AITrace.h"
 
 #ifdef EXAMPLE_CODE     // undefined
 
@@ -133,6 +135,7 @@ class AIPackagedTask<R(Args...)> : AIFriendOfStatefulTask {
 
   private:
     void invoke();
+    static bool is_finished(void* self) { return static_cast<AIPackagedTask*>(self)->m_phase == finished; }
 };
 
 template<typename R, typename ...Args>
@@ -151,7 +154,12 @@ AIPackagedTask<R(Args...)>::~AIPackagedTask()
 template<typename R, typename ...Args>
 inline void AIPackagedTask<R(Args...)>::invoke()
 {
+  AITaskAccounting::tick_type const start = AITaskAccounting::now();
   m_delayed_function.invoke();
+  AITaskAccounting::tick_type const end = AITaskAccounting::now();
+  // Attribute the time spent to the class of the task that dispatched this job.
+  AITaskAccounting::add_pool_job(typeid(*m_parent_task), end - start);
+  AITrace::job(m_parent_task, typeid(*m_parent_task), start, end);
   m_phase = finished;
   m_parent_task->signal(m_condition);
 }
@@ -196,8 +204,9 @@ bool AIPackagedTask<R(Args...)>::dispatch()
   {
     // Stop a new queue from being created while we're working with a queue, because that could move the queue.
     auto queues_r = AIThreadPool::instance().queues_read_access();
-    // Lock the queue.
-    auto& queue_ref = AIThreadPool::instance().get_queue(queues_r, m_queue_handle);
+    // Lock the queue, using the ring buffer of the priority class of the parent task.
+    static_assert(AIThreadPool::PriorityQueue::number_of_classes == AIStatefulTask::number_of_priorities, "Priority classes mismatch");
+    auto& queue_ref = AIThreadPool::instance().get_queue(queues_r, m_queue_handle).for_class(m_parent_task->priority());
     auto queue = queue_ref.producer_access();
     if (queue.length() == queue_ref.capacity())
     {
@@ -210,6 +219,6 @@ bool AIPackagedTask<R(Args...)>::dispatch()
   } // Unlock queue. And we're done with the queue, so also unlock AIThreadPool::m_queues.
 
   // Halt task until job finished.
-  wait_until([this](){ return m_phase == finished; }, m_condition);
+  wait_until(&AIPackagedTask::is_finished, this, m_condition);
   return true;
 }
@@ -0,0 +1,352 @@
+/**
+ * @file
+ * @brief Hardware performance counters per task class and state. Implementation of class AIPerfCounters.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#include "sys.h"
+#include "AIPerfCounters.h"
+#include "debug.h"
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <cxxabi.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct Totals {
+  // Only written by the thread that owns them; read by totals().
+  std::atomic<uint64_t> runs;
+  std::atomic<uint64_t> counts[AIPerfCounters::number_of_counters];
+  Totals() : runs(0) { for (auto& count : counts) count.store(0, std::memory_order_relaxed); }
+};
+
+// Single writer increment; much cheaper than a fetch_add.
+inline void increment(std::atomic<uint64_t>& counter, uint64_t delta)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// Runs are keyed by the address of the type_info and of the name of the state, which is cheap to hash.
+// totals() merges keys that turn out to be equal, in case those addresses aren't unique.
+using thread_key_type = std::pair<std::type_info const*, char const*>;
+
+struct ThreadKeyHash {
+  size_t operator()(thread_key_type const& key) const
+  {
+    return std::hash<void const*>()(key.first) ^ (std::hash<void const*>()(key.second) * 31);
+  }
+};
+
+struct ThreadCounters;
+
+// All ThreadCounters that currently exist, plus the totals of threads that already exited.
+struct Registry {
+  std::mutex mutex;
+  std::set<ThreadCounters*> threads;
+  AIPerfCounters::container_type retired;
+};
+
+Registry& registry()
+{
+  // Constructed on first use and never destructed, so that threads that exit during static destruction can still use it.
+  static Registry* registry = new Registry;
+  return *registry;
+}
+
+struct ThreadCounters {
+  // The file descriptors of the perf events of this thread, opened by open().
+  int m_fds[AIPerfCounters::number_of_counters];        // -1 if that counter isn't available.
+  int m_group_fd;                                       // The group leader, or -1 if no counter is available.
+  int m_index[AIPerfCounters::number_of_counters];      // The index of each counter in the values read from the group, or -1.
+  int m_number_of_events;                               // The number of counters in the group.
+  bool m_opened;                                        // Set when open() was called.
+
+  // The map is only changed by the owning thread, while holding mutex.
+  // The owning thread may read it without locking; other threads must lock mutex.
+  std::mutex mutex;
+  std::unordered_map<thread_key_type, Totals, ThreadKeyHash> map;
+  // The most recently used totals; most threads run the same task over and over.
+  thread_key_type m_last_key;
+  Totals* m_last_totals;
+
+  ThreadCounters() : m_group_fd(-1), m_number_of_events(0), m_opened(false), m_last_key(nullptr, nullptr), m_last_totals(nullptr)
+  {
+    for (int counter = 0; counter < AIPerfCounters::number_of_counters; ++counter)
+    {
+      m_fds[counter] = -1;
+      m_index[counter] = -1;
+    }
+    Registry& r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.threads.insert(this);
+  }
+
+  ~ThreadCounters()
+  {
+    {
+      Registry& r(registry());
+      std::lock_guard<std::mutex> lock(r.mutex);
+      for (auto& entry : map)
+        add_to(r.retired, entry.first, entry.second);
+      r.threads.erase(this);
+    }
+#ifdef __linux__
+    for (int counter = 0; counter < AIPerfCounters::number_of_counters; ++counter)
+      if (m_fds[counter] != -1)
+        close(m_fds[counter]);
+#endif
+  }
+
+  static void add_to(AIPerfCounters::container_type& result, thread_key_type const& key, Totals const& totals)
+  {
+    AIPerfCounters::totals_st& sum(result[AIPerfCounters::key_type(std::type_index(*key.first), key.second)]);
+    sum.runs += totals.runs.load(std::memory_order_relaxed);
+    for (int counter = 0; counter < AIPerfCounters::number_of_counters; ++counter)
+      sum.counts[counter] += totals.counts[counter].load(std::memory_order_relaxed);
+  }
+
+  // Open the counters of this thread. Returns false if no counter could be opened.
+  bool open();
+
+  Totals& get(thread_key_type const& key)
+  {
+    if (AI_LIKELY(m_last_totals && key == m_last_key))
+      return *m_last_totals;
+    auto iter = map.find(key);
+    if (AI_UNLIKELY(iter == map.end()))
+    {
+      // First time this thread sees this task class and state.
+      std::lock_guard<std::mutex> lock(mutex);
+      iter = map.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first;
+    }
+    m_last_key = key;
+    m_last_totals = &iter->second;
+    return iter->second;
+  }
+};
+
+bool ThreadCounters::open()
+{
+  m_opened = true;
+#ifdef __linux__
+  static uint64_t const configs[AIPerfCounters::number_of_counters] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES
+  };
+  for (int counter = 0; counter < AIPerfCounters::number_of_counters; ++counter)
+  {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = configs[counter];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Count the calling thread, on any cpu.
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, m_group_fd, 0);
+    if (fd == -1)
+    {
+      Dout(dc::warning, "AIPerfCounters: cannot open " << AIPerfCounters::counter_name(static_cast<AIPerfCounters::counter_type>(counter)) << " counter: " << std::strerror(errno));
+      continue;
+    }
+    m_fds[counter] = fd;
+    if (m_group_fd == -1)
+      m_group_fd = fd;
+    m_index[counter] = m_number_of_events++;
+  }
+#endif
+  return m_group_fd != -1;
+}
+
+thread_local ThreadCounters t_counters;
+
+} // namespace
+
+//static
+std::atomic<bool> AIPerfCounters::s_started(false);
+
+//static
+char const* AIPerfCounters::counter_name(counter_type counter)
+{
+  switch (counter)
+  {
+    case cycles:
+      return "cycles";
+    case instructions:
+      return "instructions";
+    case llc_misses:
+      return "llc_misses";
+    case number_of_counters:
+      break;
+  }
+  return "unknown";
+}
+
+//static
+bool AIPerfCounters::start()
+{
+  ThreadCounters& thread_counters(t_counters);
+  if (!thread_counters.m_opened)
+    thread_counters.open();
+  if (thread_counters.m_group_fd == -1)
+    return false;
+  s_started.store(true, std::memory_order_relaxed);
+  return true;
+}
+
+//static
+bool AIPerfCounters::read(sample_st& sample)
+{
+#ifdef __linux__
+  ThreadCounters& thread_counters(t_counters);
+  if (AI_UNLIKELY(!thread_counters.m_opened))
+    thread_counters.open();
+  if (AI_UNLIKELY(thread_counters.m_group_fd == -1))
+    return false;
+  // The layout of a PERF_FORMAT_GROUP read: the number of events, followed by their values.
+  uint64_t values[1 + number_of_counters];
+  ssize_t const len = ::read(thread_counters.m_group_fd, values, sizeof(values));
+  if (AI_UNLIKELY(len < static_cast<ssize_t>((1 + thread_counters.m_number_of_events) * sizeof(uint64_t))))
+    return false;
+  for (int counter = 0; counter < number_of_counters; ++counter)
+  {
+    int const index = thread_counters.m_index[counter];
+    sample.counts[counter] = index == -1 ? 0 : values[1 + index];
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+//static
+void AIPerfCounters::add(sample_st const& before, std::type_info const& task_class, char const* state_name)
+{
+  sample_st after;
+  if (AI_UNLIKELY(!read(after)))
+    return;
+  Totals& totals(t_counters.get(thread_key_type(&task_class, state_name)));
+  increment(totals.runs, 1);
+  for (int counter = 0; counter < number_of_counters; ++counter)
+    increment(totals.counts[counter], after.counts[counter] - before.counts[counter]);
+}
+
+//static
+void AIPerfCounters::clear()
+{
+  ASSERT(!enabled());
+  Registry& r(registry());
+  std::lock_guard<std::mutex> registry_lock(r.mutex);
+  r.retired.clear();
+  for (ThreadCounters* thread_counters : r.threads)
+  {
+    std::lock_guard<std::mutex> lock(thread_counters->mutex);
+    for (auto& entry : thread_counters->map)
+    {
+      entry.second.runs.store(0, std::memory_order_relaxed);
+      for (auto& count : entry.second.counts)
+        count.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+//static
+AIPerfCounters::container_type AIPerfCounters::totals()
+{
+  container_type result;
+  Registry& r(registry());
+  std::lock_guard<std::mutex> registry_lock(r.mutex);
+  for (auto& entry : r.retired)
+    result[entry.first] = entry.second;
+  for (ThreadCounters* thread_counters : r.threads)
+  {
+    std::lock_guard<std::mutex> lock(thread_counters->mutex);
+    for (auto& entry : thread_counters->map)
+      ThreadCounters::add_to(result, entry.first, entry.second);
+  }
+  return result;
+}
+
+namespace {
+
+std::string demangled_name(std::type_index const& type)
+{
+  int status;
+  char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+  std::string name(status == 0 ? demangled : type.name());
+  std::free(demangled);
+  return name;
+}
+
+} // namespace
+
+//static
+void AIPerfCounters::print_on(std::ostream& os)
+{
+  std::ios_base::fmtflags const flags = os.flags();
+  std::streamsize const precision = os.precision();
+  for (auto& entry : totals())
+  {
+    totals_st const& totals(entry.second);
+    os << std::setw(40) << std::left << demangled_name(entry.first.first) << ' ' << std::setw(30) << entry.first.second << std::right <<
+        " runs: " << std::setw(10) << totals.runs;
+    for (int counter = 0; counter < number_of_counters; ++counter)
+      os << "; " << counter_name(static_cast<counter_type>(counter)) << ": " << std::setw(12) << totals.counts[counter];
+    os << "; IPC: " << std::fixed << std::setprecision(2) <<
+        (totals.counts[cycles] ? static_cast<double>(totals.counts[instructions]) / totals.counts[cycles] : 0.0) << '\n';
+    os.flags(flags);
+    os.precision(precision);
+  }
+}
+
+//static
+void AIPerfCounters::write_csv(std::ostream& os)
+{
+  os << "task_class,state,runs";
+  for (int counter = 0; counter < number_of_counters; ++counter)
+    os << ',' << counter_name(static_cast<counter_type>(counter));
+  os << '\n';
+  for (auto& entry : totals())
+  {
+    // Type names can contain commas (template arguments), so quote them.
+    os << '"' << demangled_name(entry.first.first) << "\",\"" << entry.first.second << "\"," << entry.second.runs;
+    for (int counter = 0; counter < number_of_counters; ++counter)
+      os << ',' << entry.second.counts[counter];
+    os << '\n';
+  }
+}
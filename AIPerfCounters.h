@@ -0,0 +1,126 @@
+/**
+ * @file
+ * @brief Hardware performance counters per task class and state. Declaration of class AIPerfCounters.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#pragma once
+
+#include "utils/macros.h"
+#include <atomic>
+#include <map>
+#include <string>
+#include <utility>
+#include <iosfwd>
+#include <typeinfo>
+#include <typeindex>
+#include <cstdint>
+
+// Hardware performance counters per task class and per state, to find out
+// whether the time that a task class spends (see AITaskAccounting) is due
+// to cache misses or due to executing many instructions.
+//
+// While started, every run of a task (one call to one of the *_impl() functions
+// from multiplex()) reads the counters of the current thread before and after
+// the run and adds the difference to the totals of the class of the task and the
+// state that was run: the name returned by state_str_impl(), or the name of the
+// base state (like "bs_initialize") for the other *_impl() functions.
+// Only user space is counted.
+//
+// Each thread opens its counters with perf_event_open(2) the first time that it runs
+// a task while started. If that isn't permitted (see /proc/sys/kernel/perf_event_paranoid),
+// or when not running on linux, start() returns false and nothing is counted. A single
+// counter that the hardware doesn't have (LLC misses in many virtual machines) stays zero.
+//
+// Reading the counters costs two system calls per run, so this is meant for profiling
+// sessions. When stopped, each run costs one relaxed atomic load.
+//
+// Usage:
+//
+// if (!AIPerfCounters::start())
+//   std::cerr << "Hardware performance counters are not available.\n";
+// ...
+// AIPerfCounters::stop();
+// AIPerfCounters::print_on(std::cout);        // Print a table per task class and state.
+// std::ofstream file("counters.csv");
+// AIPerfCounters::write_csv(file);            // Or export everything as CSV.
+//
+class AIPerfCounters
+{
+  public:
+    enum counter_type {
+      cycles,                                   // CPU cycles.
+      instructions,                             // Retired instructions.
+      llc_misses,                               // Last level cache misses.
+      number_of_counters
+    };
+
+    struct totals_st {
+      uint64_t runs;                            // The number of runs that were counted.
+      uint64_t counts[number_of_counters];      // The sum of each counter over those runs.
+      totals_st() : runs(0), counts() { }
+    };
+    using key_type = std::pair<std::type_index, std::string>;   // The task class and the name of the state.
+    using container_type = std::map<key_type, totals_st>;
+
+    // A reading of the counters of the current thread.
+    struct sample_st {
+      uint64_t counts[number_of_counters];
+    };
+
+  private:
+    static std::atomic<bool> s_started;
+
+    static bool read(sample_st& sample);
+    static void add(sample_st const& before, std::type_info const& task_class, char const* state_name);
+
+  public:
+    // Start counting. Returns false (and doesn't start) if the counters can't be opened.
+    static bool start();
+    // Stop counting. The totals are kept.
+    static void stop() { s_started.store(false, std::memory_order_relaxed); }
+    // Return true while started.
+    static bool enabled() { return AI_UNLIKELY(s_started.load(std::memory_order_relaxed)); }
+    // Discard all totals. Only call this while stopped.
+    static void clear();
+
+    // Hooks used by AIStatefulTask::multiplex().
+    // Read the counters of the current thread into `before'. Returns false when nothing should be counted.
+    static bool begin(sample_st& before) { return enabled() && read(before); }
+    // Add the difference since begin() to the totals of `task_class' / `state_name'.
+    // `state_name' must be a string literal, or at least live till the end of the program.
+    static void end(sample_st const& before, std::type_info const& task_class, char const* state_name) { add(before, task_class, state_name); }
+
+    // Return the name of `counter', as used by print_on() and write_csv().
+    static char const* counter_name(counter_type counter);
+
+    // Return the totals per task class and state, summed over all threads (including threads that already exited).
+    static container_type totals();
+
+    // Write totals() in human readable form to os, including the instructions per cycle.
+    static void print_on(std::ostream& os);
+
+    // Write totals() as CSV to os, with one header line.
+    static void write_csv(std::ostream& os);
+};
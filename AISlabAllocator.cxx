@@ -0,0 +1,81 @@
+/**
+ * @file
+ * @brief Implementation of AISlabAllocator.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+#include "sys.h"
+#include "AISlabAllocator.h"
+#include "debug.h"
+
+AISlabAllocator::AISlabAllocator(size_t object_size, size_t blocks_per_slab) :
+    m_block_size((sizeof(block_st) + object_size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1)),
+    m_blocks_per_slab(blocks_per_slab), m_slabs(0)
+{
+  ASSERT(blocks_per_slab > 0);
+}
+
+AISlabAllocator::cache_st* AISlabAllocator::adopt()
+{
+  cache_st* cache;
+  {
+    orphans_type::wat orphans_w(m_orphans);
+    if (orphans_w->empty())
+      cache = new cache_st;
+    else
+    {
+      cache = orphans_w->back();
+      orphans_w->pop_back();
+    }
+  }
+  cache->owner_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  return cache;
+}
+
+void AISlabAllocator::release(cache_st* cache)
+{
+  // From now on blocks of this cache that are freed (by any thread) go to its remote free list.
+  cache->owner_thread.store(std::thread::id(), std::memory_order_relaxed);
+  orphans_type::wat orphans_w(m_orphans);
+  orphans_w->push_back(cache);
+}
+
+AISlabAllocator::block_st* AISlabAllocator::refill(cache_st* cache)
+{
+  // Only the owner thread takes blocks from the remote free list, and it takes all of them at once,
+  // so there is no ABA problem here.
+  block_st* head = cache->remote_free_list.exchange(nullptr, std::memory_order_acquire);
+  if (head)
+    return head;
+  char* slab = static_cast<char*>(::operator new(m_blocks_per_slab * m_block_size));
+  m_slabs.fetch_add(1, std::memory_order_relaxed);
+  block_st* next = nullptr;
+  for (size_t i = m_blocks_per_slab; i > 0; --i)
+  {
+    block_st* block = reinterpret_cast<block_st*>(slab + (i - 1) * m_block_size);
+    block->owner = cache;
+    block->next = next;
+    next = block;
+  }
+  return next;
+}
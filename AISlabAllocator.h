@@ -0,0 +1,177 @@
+/**
+ * @file
+ * @brief Per class slab allocator with per-thread caches for stateful tasks.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+#pragma once
+
+#include "threadsafe/aithreadsafe.h"
+#include "utils/macros.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <cstddef>
+#include <new>
+
+// A slab allocator for objects of a single size.
+//
+// Memory is obtained in slabs of blocks_per_slab blocks at a time and carved up into blocks
+// that are kept on free lists. Every thread that allocates gets its own cache, so that
+// allocating and freeing on the same thread doesn't need any atomic read-modify-write.
+// A block that is freed by another thread is pushed onto a lock-free list of the cache
+// that it belongs to, and is picked up by that cache the next time its own free list runs dry.
+//
+// When a thread exits its cache (including the blocks on it) is put aside and adopted
+// by the next thread that starts to allocate. Memory is never returned to the system.
+//
+// Normally this class isn't used directly; derive from AISlabAllocated instead (see below).
+//
+class AISlabAllocator
+{
+  private:
+    struct cache_st;
+
+    // Every block starts with this header; the object follows it.
+    struct alignas(alignof(std::max_align_t)) block_st {
+      cache_st* owner;                          // The cache whose slab this block was carved from.
+      block_st* next;                           // The next free block, while this block is on a free list.
+    };
+
+    struct cache_st {
+      std::atomic<std::thread::id> owner_thread;        // The thread that uses this cache, or std::thread::id() when orphaned.
+      block_st* free_list;                              // Only accessed by the owner thread.
+      std::atomic<block_st*> remote_free_list;          // Blocks that were freed by other threads.
+      cache_st() : owner_thread(std::thread::id()), free_list(nullptr), remote_free_list(nullptr) { }
+    };
+
+    size_t const m_block_size;                  // The size of a block, including its header.
+    size_t const m_blocks_per_slab;
+    std::atomic<size_t> m_slabs;                // The number of slabs that were allocated.
+    using orphans_type = aithreadsafe::Wrapper<std::vector<cache_st*>, aithreadsafe::policy::Primitive<std::mutex>>;
+    orphans_type m_orphans;                     // Caches of threads that exited.
+
+  public:
+    // A per thread handle to the cache of this thread. Returns the cache to the allocator when the thread exits.
+    class ThreadCache {
+      private:
+        AISlabAllocator& m_allocator;
+        cache_st* m_cache;
+
+      public:
+        ThreadCache(AISlabAllocator& allocator) : m_allocator(allocator), m_cache(nullptr) { }
+        ~ThreadCache() { if (m_cache) m_allocator.release(m_cache); }
+        ThreadCache(ThreadCache const&) = delete;
+        friend class AISlabAllocator;
+    };
+
+    AISlabAllocator(size_t object_size, size_t blocks_per_slab);
+    AISlabAllocator(AISlabAllocator const&) = delete;
+
+    // Return a block of at least object_size bytes, aligned like std::max_align_t.
+    void* allocate(ThreadCache& thread_cache)
+    {
+      cache_st* cache = thread_cache.m_cache;
+      if (AI_UNLIKELY(!cache))
+        cache = thread_cache.m_cache = adopt();
+      block_st* block = cache->free_list;
+      if (AI_UNLIKELY(!block))
+        block = refill(cache);
+      cache->free_list = block->next;
+      return block + 1;
+    }
+
+    // Free a block that was returned by allocate() of any AISlabAllocator, from any thread.
+    static void deallocate(void* ptr)
+    {
+      block_st* block = static_cast<block_st*>(ptr) - 1;
+      cache_st* cache = block->owner;
+      if (AI_LIKELY(cache->owner_thread.load(std::memory_order_relaxed) == std::this_thread::get_id()))
+      {
+        block->next = cache->free_list;
+        cache->free_list = block;
+      }
+      else
+      {
+        block_st* head = cache->remote_free_list.load(std::memory_order_relaxed);
+        do
+          block->next = head;
+        while (!cache->remote_free_list.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+      }
+    }
+
+    // Return the number of bytes that were obtained from the system.
+    size_t memory_in_use() const { return m_slabs.load(std::memory_order_relaxed) * m_blocks_per_slab * m_block_size; }
+
+  private:
+    cache_st* adopt();                          // Return an orphaned cache, or a new one, owned by the current thread.
+    void release(cache_st* cache);              // Orphan cache (called when its thread exits).
+    block_st* refill(cache_st* cache);          // Move the remote free list to the free list, or allocate a new slab. Returns the first free block.
+};
+
+// Derive from this class to let objects of the most derived class `T' be allocated with a slab allocator.
+//
+// Usage:
+//
+// class MyTask : public AIStatefulTask, public AISlabAllocated<MyTask>
+// {
+//   ...
+// };
+//
+// Objects of classes that are derived from MyTask are larger than MyTask
+// and fall back to the global operator new (unless they derive from AISlabAllocated too).
+// The class must have a virtual destructor (as every AIStatefulTask has),
+// so that operator delete is passed the size of the most derived class.
+//
+template<class T, size_t blocks_per_slab = 64>
+class AISlabAllocated
+{
+  private:
+    static AISlabAllocator& allocator()
+    {
+      // Constructed on first use and never destructed, because objects might be freed by threads that exit during static destruction.
+      static AISlabAllocator* allocator = new AISlabAllocator(sizeof(T), blocks_per_slab);
+      return *allocator;
+    }
+
+  public:
+    static void* operator new(size_t size)
+    {
+      if (AI_UNLIKELY(size != sizeof(T)))
+        return ::operator new(size);
+      static thread_local AISlabAllocator::ThreadCache thread_cache(allocator());
+      return allocator().allocate(thread_cache);
+    }
+
+    static void operator delete(void* ptr, size_t size)
+    {
+      if (AI_UNLIKELY(size != sizeof(T)))
+        ::operator delete(ptr);
+      else
+        AISlabAllocator::deallocate(ptr);
+    }
+
+    // Return the number of bytes that were obtained from the system for objects of type T.
+    static size_t memory_in_use() { return allocator().memory_in_use(); }
+};
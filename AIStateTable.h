@@ -0,0 +1,137 @@
+/**
+ * @file
+ * @brief Declare the run states of a task once. Definition of macro AI_STATE_TABLE.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#pragma once
+
+#include "AIStatefulTask.h"
+#include "debug.h"
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/logical/not.hpp>
+#include <boost/preprocessor/punctuation/comma_if.hpp>
+#include <boost/preprocessor/control/expr_if.hpp>
+#include <boost/preprocessor/seq/for_each.hpp>
+#include <boost/preprocessor/seq/for_each_i.hpp>
+#include <boost/preprocessor/stringize.hpp>
+#include <boost/preprocessor/variadic/to_seq.hpp>
+#include <type_traits>
+
+#ifdef EXAMPLE_CODE     // undefined
+
+class Task : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;            // The base class of this task.
+    ~Task() override { }                                // The destructor must be protected.
+
+    // The different states of the task. This declares
+    //   enum state_table_type { Task_start = direct_base_type::max_state, Task_wait, Task_done, state_table_end };
+    // a member function void X_impl() for every state X, the overrides of state_str_impl() and multiplex_impl()
+    // and static state_type const max_state = state_table_end (one beyond the largest state).
+    AI_STATE_TABLE(Task, Task_start, Task_wait, Task_done);
+
+  public:
+    Task() : AIStatefulTask(DEBUG_ONLY(true)) { }
+};
+
+void Task::Task_start_impl()
+{
+  set_state(Task_wait);
+  wait(1);
+}
+
+void Task::Task_wait_impl()
+{
+  set_state(Task_done);
+}
+
+void Task::Task_done_impl()
+{
+  finish();
+}
+#endif // EXAMPLE_CODE
+
+// AI_STATE_TABLE(task, state1, state2, ...)
+//
+// Declares the run states of class `task' once, replacing the hand written
+// enum, state_str_impl() and the switch in multiplex_impl().
+//
+// The states are numbered from direct_base_type::max_state on, in the order given;
+// state_table_end is one beyond the last state. The macro also declares max_state
+// (equal to state_table_end), so the task must not declare it itself.
+// Every state X is handled by a member function void X_impl() that must be defined
+// by the user. multiplex_impl() calls it through a constant table of member function
+// pointers that is indexed with the run state. Run states below direct_base_type::max_state
+// are passed on to the multiplex_impl() and state_str_impl() of direct_base_type,
+// unless that is AIStatefulTask (see HelloWorld in AIStatefulTask.cxx).
+//
+// The macro must be used inside the class body, in the section where the
+// states and the member functions that handle them should be accessible
+// (normally protected). That is also where max_state ends up; a task that is
+// derived from this one only needs it as direct_base_type::max_state.
+//
+// AI_STATE_TABLE(...) is followed by a semicolon, like a declaration: the
+// macro ends with the declaration of max_state, which that semicolon completes.
+//
+#define AI_STATE_TABLE(task, ...) \
+    AI_STATE_TABLE_SEQ(task, BOOST_PP_VARIADIC_TO_SEQ(__VA_ARGS__))
+
+#define AI_STATE_TABLE_SEQ(task, states) \
+    enum state_table_type { \
+      BOOST_PP_SEQ_FOR_EACH_I(AI_STATE_TABLE_ENUMERATOR, _, states) \
+      state_table_end \
+    }; \
+    BOOST_PP_SEQ_FOR_EACH(AI_STATE_TABLE_DECLARATION, _, states) \
+    void multiplex_impl(state_type run_state) override \
+    { \
+      using handler_type = void (task::*)(); \
+      static constexpr handler_type handlers[] = { BOOST_PP_SEQ_FOR_EACH_I(AI_STATE_TABLE_HANDLER, task, states) }; \
+      if (run_state < direct_base_type::max_state) \
+      { \
+        state_table_base_multiplex<direct_base_type>(run_state, std::is_same<direct_base_type, AIStatefulTask>()); \
+        return; \
+      } \
+      ASSERT(run_state < state_table_end); \
+      (this->*handlers[run_state - direct_base_type::max_state])(); \
+    } \
+    char const* state_str_impl(state_type run_state) const override \
+    { \
+      static char const* const names[] = { BOOST_PP_SEQ_FOR_EACH_I(AI_STATE_TABLE_NAME, _, states) }; \
+      if (run_state < direct_base_type::max_state) \
+        return state_table_base_state_str<direct_base_type>(run_state, std::is_same<direct_base_type, AIStatefulTask>()); \
+      ASSERT(run_state < state_table_end); \
+      return names[run_state - direct_base_type::max_state]; \
+    } \
+    /* Templates, so that only the overload that is used is instantiated: AIStatefulTask has no definitions to call. */ \
+    template<typename base_type> void state_table_base_multiplex(state_type run_state, std::false_type) { base_type::multiplex_impl(run_state); } \
+    template<typename base_type> void state_table_base_multiplex(state_type, std::true_type) { ASSERT(false); } \
+    template<typename base_type> char const* state_table_base_state_str(state_type run_state, std::false_type) const { return base_type::state_str_impl(run_state); } \
+    template<typename base_type> char const* state_table_base_state_str(state_type, std::true_type) const { ASSERT(false); return "UNKNOWN STATE"; } \
+    static state_type const max_state = state_table_end
+
+#define AI_STATE_TABLE_ENUMERATOR(r, data, i, state) state BOOST_PP_EXPR_IF(BOOST_PP_NOT(i), = direct_base_type::max_state),
+#define AI_STATE_TABLE_DECLARATION(r, data, state) void BOOST_PP_CAT(state, _impl)();
+#define AI_STATE_TABLE_HANDLER(r, task, i, state) BOOST_PP_COMMA_IF(i) &task::BOOST_PP_CAT(state, _impl)
+#define AI_STATE_TABLE_NAME(r, data, i, state) BOOST_PP_COMMA_IF(i) BOOST_PP_STRINGIZE(state)
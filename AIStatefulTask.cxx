@@ -36,6 +36,17 @@
 
 #include "sys.h"
 #include "AIEngine.h"
+#include "AIAuxiliaryThread.h"
+#include "AITaskAccounting.h"
+#include "AITrace.h"
+#include "AIWakeUpLatency.h"
+#include "AIPerfCounters.h"
+#include "AIWaitTimeouts.h"
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 //==================================================================
 // Overview
@@ -303,6 +314,36 @@ hello_world->run(...);          // One of the run() functions.
 // is ok, rather marks the need to continue running which should be picked up upon return from
 // whatever the running thread is calling.
 
+//static
+unsigned int AIStatefulTask::sMaxContinuationDepth;
+
+namespace {
+
+// A parent task that was woken up by a child that finished in this thread (see signal_continuation()).
+struct continuation_st {
+  AIStatefulTask const* child;                          // The child whose multiplex() should run the parent when it returns, or nullptr.
+  boost::intrusive_ptr<AIStatefulTask> parent;
+  AIEngine* engine;                                     // The engine that the child was running in.
+};
+
+thread_local continuation_st t_continuation;
+thread_local unsigned int t_continuation_depth;         // The number of nested continuations that this thread is running.
+
+// Used by abort() to block until the current run (in another thread) finished.
+// Only used when a task has control_run_waiter set, so a single pair for all tasks suffices.
+std::mutex s_run_finished_mutex;
+std::condition_variable s_run_finished;
+
+// Called after clearing control_run while control_run_waiter was set, after the control word was unlocked.
+void notify_run_finished()
+{
+  // Locking the mutex makes sure that abort() is either already waiting, or didn't test the control word yet.
+  std::lock_guard<std::mutex> lock(s_run_finished_mutex);
+  s_run_finished.notify_all();
+}
+
+} // namespace
+
 #ifdef CWDEBUG
 char const* AIStatefulTask::event_str(event_type event)
 {
@@ -312,22 +353,45 @@ char const* AIStatefulTask::event_str(event_type event)
     AI_CASE_RETURN(schedule_run);
     AI_CASE_RETURN(normal_run);
     AI_CASE_RETURN(insert_abort);
+    AI_CASE_RETURN(continue_run);
+    AI_CASE_RETURN(deferred_run);
   }
   ASSERT(false);
   return "UNKNOWN EVENT";
 }
 #endif
 
+uint64_t AIStatefulTask::lock_control() const
+{
+  uint64_t control = mControl.load(std::memory_order_relaxed);
+  for (int spins = 0;; ++spins)
+  {
+    if (!(control & control_locked))
+    {
+      if (mControl.compare_exchange_weak(control, control | control_locked, std::memory_order_acquire, std::memory_order_relaxed))
+        return control;
+      continue;
+    }
+    // The lock is only ever held for a handful of instructions (or the time it takes
+    // AIEngine::add() to append to its queue), so spinning is cheap; but don't
+    // burn a whole time slice when the holder was preempted.
+    if (spins > 64)
+      std::this_thread::yield();
+    control = mControl.load(std::memory_order_relaxed);
+  }
+}
+
 bool AIStatefulTask::waiting() const
 {
-  multiplex_state_type::crat state_r(mState);
-  return state_r->base_state == bs_multiplex && sub_state_type::crat(mSubState)->idle;
+  uint64_t const control = mControl.load(std::memory_order_acquire);
+  return (control & control_base_state_mask) == bs_multiplex && (control & control_idle_mask);
 }
 
 bool AIStatefulTask::waiting_or_aborting() const
 {
-  multiplex_state_type::crat state_r(mState);
-  return state_r->base_state == bs_abort || ( state_r->base_state == bs_multiplex && sub_state_type::crat(mSubState)->idle);
+  uint64_t const control = mControl.load(std::memory_order_acquire);
+  base_state_type const base_state = static_cast<base_state_type>(control & control_base_state_mask);
+  return base_state == bs_abort || (base_state == bs_multiplex && (control & control_idle_mask));
 }
 
 void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
@@ -340,33 +404,46 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
   base_state_type state;
   state_type run_state;
   bool waiting;
+  bool late_abort;
+  bool continuation = false;                    // Set when this is a continue_run that runs here.
+  bool deferred = false;                        // Set when this task may not run in the thread that called signal().
+  AIEngine* deferred_engine = nullptr;          // The engine to add the task to instead, or nullptr for AIAuxiliaryThread::engine_for().
+  if (event == deferred_run)
+  {
+    // Called from signal_deferred(); engine is the engine that was passed to it.
+    deferred = true;
+    deferred_engine = engine;
+    engine = nullptr;
+    event = schedule_run;
+  }
+  AIEngine* const calling_engine = engine;      // The engine whose thread we are running in (or the one the child that woke us up ran in), if any.
 
-  // Critical area of mState.
+  // Critical area of the control word.
   {
-    multiplex_state_type::rat state_r(mState);
+    ControlLock control(this);
 
     // This would be an almost impossible race condition.
-    if (AI_UNLIKELY(event == insert_abort && state_r->base_state != bs_multiplex))
+    if (AI_UNLIKELY(event == insert_abort && control.base_state() != bs_multiplex))
     {
       Dout(dc::statefultask(mSMDebug), "Leaving because the task finished in the meantime [" << (void*)this << "]");
       return;
     }
 
-    if (event == normal_run && engine != state_r->current_engine)
+    if (event == normal_run && engine != mCurrentEngine.load(std::memory_order_relaxed))
     {
       Dout(dc::statefultask(mSMDebug), "Leaving because current_engine isn't equal to calling engine [" << (void*)this << "]");
       return;
     }
 
     // multiplex(schedule_run) is only called from signal(condition) provided that
-    // mSubState.idle & condition is non-zero, which is never true when idle is set to
+    // idle & condition is non-zero, which is never true when idle is set to
     // zero; idle is set to zero upon a call to abort() or finish() which are
     // the only two ways to leave the bs_multiplex state. And since idle is only
     // set by a call to wait(), which may only be called from multiplex_impl, we can
     // be sure to be in the bs_multiplex state when multiplex(schedule_run) is called.
     //
     // multiplex(insert_abort) is only called while the task is still running (see
-    // abort()), that is, very shortly after releasing the lock on mState during which
+    // abort()), that is, very shortly after releasing the lock on the control word during which
     // this was tested. In the extremely unlikely case that this changed in the meantime
     // we already left this function in the above test.
     //
@@ -374,14 +451,14 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
     // in the engines queue (which are removed when current_engine stops being
     // equal to that engine; and we return if the above test fails anyway). Hence,
     // we get here only for tasks with a non-null current_engine, but for any base state.
-    ASSERT(event != initial_run || state_r->base_state == bs_reset);
-    ASSERT((event != schedule_run && event != insert_abort) || state_r->base_state == bs_multiplex);
+    ASSERT(event != initial_run || control.base_state() == bs_reset);
+    ASSERT((event != schedule_run && event != insert_abort && event != continue_run) || control.base_state() == bs_multiplex);
 
     // If another thread is already running multiplex() then it will pick up
     // our need to run (by us having set need_run), so there is no need to run
     // ourselves.
-    ASSERT(!mMultiplexMutex.self_locked());    // We may never enter recursively!
-    if (!mMultiplexMutex.try_lock())
+    ASSERT(!executing());                       // We may never enter recursively!
+    if (control.test(control_multiplex))
     {
       // This just should never happen; a call to run() should always set the base state beyond bs_reset.
       ASSERT(event != initial_run);
@@ -389,33 +466,53 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
       return;
     }
 
-    //===========================================
-    // Start of critical area of mMultiplexMutex.
-
     // If another thread already called begin_loop() since we needed a run,
     // then we must not schedule a run because that could lead to running
     // the same state twice. Note that if need_run was reset in the mean
     // time and then set again, then it can't hurt to schedule a run since
     // we should indeed run, again.
-    if (event == schedule_run && !sub_state_type::rat(mSubState)->need_run)
+    if ((event == schedule_run || event == continue_run) && !control.test(control_need_run))
     {
-      mMultiplexMutex.unlock();
       Dout(dc::statefultask(mSMDebug), "Leaving because it was already being run [" << (void*)this << "]");
       return;
     }
 
+    //=============================================
+    // Start of critical area of control_multiplex.
+    control.set(control_multiplex);
+    mMultiplexThreadId.store(std::this_thread::get_id(), std::memory_order_relaxed);
+
+    if (event == continue_run)
+    {
+      // Only run here if we'd be allowed to run in the engine of the child; otherwise just schedule a run.
+      AIEngine* const target_engine = rare_ptr() ? rare_ptr()->target_engine : nullptr;
+      AIEngine* const wanted_engine = target_engine ? target_engine : mDefaultEngine;
+      continuation = wanted_engine ? wanted_engine == calling_engine : !(rare_ptr() && rare_ptr()->defer_signals);
+      event = continuation ? normal_run : schedule_run;
+      Dout(dc::statefultask(mSMDebug && continuation), "Continuing directly after child task [" << (void*)this << "]");
+    }
+    if (event == schedule_run && !deferred && rare_ptr() && rare_ptr()->defer_signals)
+    {
+      deferred = true;
+      deferred_engine = rare_ptr()->signal_engine;
+    }
+
     // We're at the beginning of multiplex, about to actually run it.
     // Make a copy of the states.
-    waiting = state_r->wait_condition != nullptr;
-    state = state_r->base_state;
-    run_state = begin_loop();
+    waiting = rare_ptr() && rare_ptr()->wait_condition;
+    state = control.base_state();
+    run_state = begin_loop(control);
+    late_abort = start_run(control, state);
   }
-  // End of critical area of mState.
+  // End of critical area of the control word.
 
   bool keep_looping;
   bool destruct = false;
+  bool killed = false;
+  unsigned int runs = 0;        // The number of runs so far, for the run budget of the engine (see AIEngine::set_run_budget()).
   do
   {
+    bool run_waiter = false;    // Set when abort() is waiting for the run below to end.
 #ifdef CWDEBUG
     debug::Mark __mark;
 #endif
@@ -464,7 +561,7 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
       // More sanity checks.
       if (state == bs_multiplex)
       {
-        // set_state is only called from multiplex_impl and therefore synced with mMultiplexMutex.
+        // set_state is only called from multiplex_impl and therefore synced with control_multiplex.
         mDebugShouldRun |= mDebugSetStatePending;
         // Should we run at all?
         ASSERT(mDebugShouldRun);
@@ -473,10 +570,8 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
       mDebugShouldRun = false;
 #endif
 
-      mRunMutex.lock();
       // Now we are actually running a single state.
       // If abort() was called at any moment before, we execute that state instead.
-      bool const late_abort = (state == bs_multiplex || state == bs_initialize) && sub_state_type::rat(mSubState)->aborted;
       if (AI_UNLIKELY(late_abort))
       {
         // abort() was called from a child task, from another thread, while we were already scheduled to run normally from an engine.
@@ -498,11 +593,22 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
       // Make sure we only call ref() once and in balance with unref().
       if (state == bs_initialize)
       {
-        // This -- and call to ref() (and the test when we're about to call unref()) -- is all done in the critical area of mMultiplexMutex.
+        // This -- and call to ref() (and the test when we're about to call unref()) -- is all done in the critical area of control_multiplex.
         ASSERT(!mDebugRefCalled);
         mDebugRefCalled = true;
       }
 #endif
+      AITaskAccounting::tick_type const start = AITaskAccounting::now();
+      // Is this the first run since signal() made us runnable?
+      uint64_t const signal_ticks = mSignalTicks.load(std::memory_order_relaxed);
+      if (signal_ticks)
+      {
+        mSignalTicks.store(0, std::memory_order_relaxed);
+        if (AI_LIKELY(start > signal_ticks))
+          AIWakeUpLatency::add(calling_engine, typeid(*this), start - signal_ticks);
+      }
+      AIPerfCounters::sample_st perf_counters;
+      bool const count_perf = AIPerfCounters::begin(perf_counters);
       switch(state)
       {
         case bs_reset:
@@ -516,131 +622,169 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
         case bs_multiplex:
           ASSERT(!mDebugAborted);
           if (!waiting)
+          {
+            // Cancel the timeout of the last wait(), or find out that it fired (or reset timed_out() after the run that it fired).
+            if (AI_UNLIKELY(rare_ptr()) && (rare_ptr()->timed_out || (rare_ptr()->timeout_state.load(std::memory_order_relaxed) & timeout_pending)))
+              end_timeout();
             multiplex_impl(run_state);
+          }
           else
           {
-            multiplex_state_type::wat state_w(mState);
-            if (!state_w->wait_condition())
-              wait(state_w->conditions);
-            else
+            // The wait condition is only accessed by the thread that owns the task, so no lock is needed to evaluate it.
+            // A timeout of wait_until() stays pending until the wait condition becomes true.
+            bool const fired = rare_ptr()->timeout_state.load(std::memory_order_acquire) & timeout_fired;
+            if (rare_ptr()->wait_condition(rare_ptr()->wait_condition_context))
             {
-              state_w->wait_condition = nullptr;
-              sub_state_type::wat(mSubState)->idle = 0;
+              rare_ptr()->wait_condition = nullptr;
+              rare_ptr()->wait_condition_func = nullptr;
+              if (AI_UNLIKELY(rare_ptr()->timeout_state.load(std::memory_order_relaxed) & timeout_pending))
+                end_timeout();
+              rare_ptr()->timed_out = false;
+              ControlLock control(this);
+              control.set_idle(0);
 #ifdef DEBUG
               mDebugShouldRun = true;
 #endif
             }
+            else if (AI_UNLIKELY(fired))
+            {
+              // Timed out: forget the wait condition and run the current state with timed_out() returning true.
+              rare_ptr()->wait_condition = nullptr;
+              rare_ptr()->wait_condition_func = nullptr;
+              end_timeout();
+              ControlLock(this).set_idle(0);
+              multiplex_impl(run_state);
+            }
+            else
+              wait(rare_ptr()->wait_conditions);
           }
           break;
         case bs_abort:
           abort_impl();
           break;
         case bs_finish:
-          sub_state_type::wat(mSubState)->reset = false;        // By default, halt tasks when finished.
+          ControlLock(this).clear(control_reset);       // By default, halt tasks when finished.
           finish_impl();                                        // Call run() from finish_impl() or the call back to restart from the beginning.
           break;
         case bs_callback:
-          callback();
+          callback(calling_engine);
           break;
         case bs_killed:
-          mRunMutex.unlock();
+        {
+          {
+            ControlLock control(this);
+            run_waiter = control.test(control_run_waiter);
+            control.clear(control_run | control_run_waiter);
+          }
+          if (AI_UNLIKELY(run_waiter))
+            notify_run_finished();
+        }
           // bs_killed is handled when it is set. So, this must be a re-entry.
           // We can only get here when being called by an engine that we were added to before we were killed.
           // This should already be have been set to nullptr to indicate that we want to be removed from that engine.
-          ASSERT(!multiplex_state_type::rat(mState)->current_engine);
+          ASSERT(!mCurrentEngine.load(std::memory_order_relaxed));
           // Do not call unref() twice.
           return;
       }
-      mRunMutex.unlock();
+      AITaskAccounting::tick_type const end = AITaskAccounting::now();
+      // calling_engine is the engine whose thread we're running in (if any), also for a continuation.
+      AITaskAccounting::add_run(typeid(*this), calling_engine ? calling_engine->serial() : AITaskAccounting::no_engine, end - start);
+      AITrace::run(this, typeid(*this), state, run_state, start, end);
+      if (AI_UNLIKELY(count_perf))
+        AIPerfCounters::end(perf_counters, typeid(*this), state == bs_multiplex ? state_str_impl(run_state) : state_str(state));
     }
 
     {
-      multiplex_state_type::wat state_w(mState);
+      ControlLock control(this);
+
+      //============================================
+      // Start of critical area of the control word.
 
-      //=================================
-      // Start of critical area of mState
+      // End of critical area of control_run.
+      run_waiter = control.test(control_run_waiter);
+      control.clear(control_run | control_run_waiter);
 
       // Unless the state is bs_multiplex or bs_killed, the task needs to keep calling multiplex().
       bool need_new_run = true;
       if (event == normal_run || event == insert_abort)
       {
-        sub_state_type::rat sub_state_r(mSubState);
-
         if (event == normal_run)
         {
           // Switch base state as function of sub state.
           switch(state)
           {
             case bs_reset:
-              if (sub_state_r->aborted)
+              if (control.test(control_aborted))
               {
                 // We have been aborted before we could even initialize, no de-initialization is possible.
-                state_w->base_state = bs_killed;
+                control.set_base_state(bs_killed);
                 // Stop running.
                 need_new_run = false;
+                // The call back won't be called, so give the notifications requested with abort_async() here.
+                killed = true;
               }
               else
               {
                 // run() was called: call initialize_impl() next.
-                state_w->base_state = bs_initialize;
+                control.set_base_state(bs_initialize);
               }
               break;
             case bs_initialize:
-              if (sub_state_r->aborted)
+              if (control.test(control_aborted))
               {
                 // initialize_impl() called abort.
-                state_w->base_state = bs_abort;
+                control.set_base_state(bs_abort);
               }
               else
               {
                 // Start actually running.
-                state_w->base_state = bs_multiplex;
+                control.set_base_state(bs_multiplex);
                 // If the state is bs_multiplex we only need to run again when need_run was set again in the meantime or when this task isn't idle.
-                need_new_run = sub_state_r->need_run || !sub_state_r->idle;
+                need_new_run = control.test(control_need_run) || !control.idle();
               }
               break;
             case bs_multiplex:
-              if (sub_state_r->aborted)
+              if (control.test(control_aborted))
               {
                 // abort() was called.
-                state_w->base_state = bs_abort;
+                control.set_base_state(bs_abort);
               }
-              else if (sub_state_r->finished)
+              else if (control.test(control_finished))
               {
                 // finish() was called.
-                state_w->base_state = bs_finish;
+                control.set_base_state(bs_finish);
               }
               else
               {
                 // Continue in bs_multiplex.
                 // If the state is bs_multiplex we only need to run again when need_run was set again in the meantime or when this task isn't idle.
-                need_new_run = sub_state_r->need_run || !sub_state_r->idle;
+                need_new_run = control.test(control_need_run) || !control.idle();
                 // If this fails then the run state didn't change and neither wait() nor yield() was called.
-                ASSERT(!(need_new_run && !mYield && sub_state_r->run_state == run_state &&
-                       !(sub_state_r->aborted ||        // abort was called.
-                         sub_state_r->finished ||       // finish was called.
-                         sub_state_r->wait_called ||    // wait was called.
+                ASSERT(!(need_new_run && !mYield && mRunState == run_state &&
+                       !(control.test(control_aborted) ||        // abort was called.
+                         control.test(control_finished) ||       // finish was called.
+                         control.test(control_wait_called) ||    // wait was called.
                          waiting)));                    // wait_condition just became true.
               }
               break;
             case bs_abort:
               // After calling abort_impl(), call finish_impl().
-              state_w->base_state = bs_finish;
+              control.set_base_state(bs_finish);
               break;
             case bs_finish:
               // After finish_impl(), call the call back function.
-              state_w->base_state = bs_callback;
+              control.set_base_state(bs_callback);
               break;
             case bs_callback:
-              if (sub_state_r->reset)
+              if (control.test(control_reset))
               {
                 // run() was called (not followed by kill()).
-                state_w->base_state = bs_reset;
+                control.set_base_state(bs_reset);
               }
               else
               {
                 // After the call back, we're done.
-                state_w->base_state = bs_killed;
+                control.set_base_state(bs_killed);
                 // Call unref().
                 destruct = true;
                 // Stop running.
@@ -660,41 +804,64 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
           // do nothing as the task already ran and things should be processed normally
           // (in that case this is just a normal schedule which can't harm because we can't accidently
           // re-run an old run_state).
-          if (state_w->base_state == bs_multiplex)      // Still running?
+          if (control.base_state() == bs_multiplex)     // Still running?
           {
             // See the switch above for case bs_multiplex.
-            ASSERT(sub_state_r->aborted);
+            ASSERT(control.test(control_aborted));
             // abort() was called.
-            state_w->base_state = bs_abort;
+            control.set_base_state(bs_abort);
           }
         }
 
 #ifdef CWDEBUG
-        if (state != state_w->base_state)
-          Dout(dc::statefultask(mSMDebug), "Base state changed from " << state_str(state) << " to " << state_str(state_w->base_state) <<
+        if (state != control.base_state())
+          Dout(dc::statefultask(mSMDebug), "Base state changed from " << state_str(state) << " to " << state_str(control.base_state()) <<
               "; need_new_run = " << (need_new_run ? "true" : "false") << " [" << (void*)this << "]");
 #endif
       }
 
       // Figure out in which engine we should run.
-      AIEngine* engine = mTargetEngine ? mTargetEngine : (state_w->current_engine ? state_w->current_engine : mDefaultEngine);
+      AIEngine* const previous_engine = mCurrentEngine.load(std::memory_order_relaxed);
+      AIEngine* const target_engine = rare_ptr() ? rare_ptr()->target_engine : nullptr;
+      AIEngine* engine = target_engine ? target_engine : (previous_engine ? previous_engine : mDefaultEngine);
       // And the current engine we're running in.
-      AIEngine* current_engine = (event == normal_run) ? state_w->current_engine : nullptr;
+      AIEngine* current_engine = (event == normal_run) ? (continuation ? calling_engine : previous_engine) : nullptr;
 
       // Immediately run again if yield() wasn't called and it's OK to run in this thread.
       // Note that when it's OK to run in any engine (mDefaultEngine is nullptr) then the last
-      // compare is also true when current_engine == nullptr.
-      keep_looping = need_new_run && !mYield && engine == current_engine;
+      // compare is also true when current_engine == nullptr (and for a continuation).
+      keep_looping = need_new_run && !mYield && (engine == current_engine || (continuation && !engine));
       mYield = false;
+      // Don't run a task without engine in the thread that called signal_deferred() (or signal() after defer_signals()).
+      if (keep_looping && AI_UNLIKELY(deferred))
+      {
+        Dout(dc::statefultask(mSMDebug), "Deferring run to an engine [" << (void*)this << "]");
+        keep_looping = false;
+        engine = deferred_engine;
+      }
+      // A task without engine that was last added to an auxiliary thread may prefer to continue there (see AIAuxiliaryThread::affinity).
+      if (keep_looping && !engine && (!current_engine || continuation) && AI_UNLIKELY(mAffinity))
+      {
+        engine = AIAuxiliaryThread::resume_engine(this);
+        keep_looping = !engine;
+      }
+      // Put the task back in the queue of the engine that runs it when it used up the run budget of that engine.
+      if (keep_looping && current_engine && AI_UNLIKELY(current_engine->run_budget_exceeded(++runs)))
+      {
+        Dout(dc::statefultask(mSMDebug), "Run budget of " << current_engine->name() << " used up [" << (void*)this << "]");
+        keep_looping = false;
+        engine = current_engine;
+      }
 
-      Dout(dc::statefultask(mSMDebug && !keep_looping), (!need_new_run ? (state_w->current_engine ? "No need to run, removing from engine" : "No need to run") : "Need to run, adding to engine") << " [" << (void*)this << "]");
+      Dout(dc::statefultask(mSMDebug && !keep_looping), (!need_new_run ? (previous_engine ? "No need to run, removing from engine" : "No need to run") : "Need to run, adding to engine") << " [" << (void*)this << "]");
 
       if (keep_looping)
       {
         // Start a new loop.
-        waiting = state_w->wait_condition != nullptr;
-        state = state_w->base_state;
-        run_state = begin_loop();
+        waiting = rare_ptr() && rare_ptr()->wait_condition;
+        state = control.base_state();
+        run_state = begin_loop(control);
+        late_abort = start_run(control, state);
         event = normal_run;
       }
       else
@@ -703,12 +870,12 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
         {
           // engine can be nullptr here if mDefaultEngine is nullptr and we called yield() from run() (current_engine is still nullptr).
           if (!engine)
-            engine = &gAuxiliaryThreadEngine;
+            engine = AIAuxiliaryThread::engine_for(this);
           // Add us to an engine if necessary.
-          if (engine != state_w->current_engine)
+          if (engine != previous_engine)
           {
             // Mark that we want to run in this engine, and at the same time, that we don't want to run in the previous one.
-            state_w->current_engine = engine;
+            mCurrentEngine.store(engine, std::memory_order_release);
             // Actually add the task to the engine.
             engine->add(this);
           }
@@ -721,13 +888,10 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
         {
           // Remove this task from any engine,
           // causing the engine to remove us.
-          state_w->current_engine = nullptr;
+          mCurrentEngine.store(nullptr, std::memory_order_release);
         }
 
 #ifdef DEBUG
-        // Mark that we stop running the loop.
-        mThreadId = std::thread::id();
-
         if (destruct)
         {
           // We're about to call unref(). Make sure we call that in balance with ref()!
@@ -736,51 +900,80 @@ void AIStatefulTask::multiplex(event_type event, AIEngine* engine)
         }
 #endif
 
-        // End of critical area of mMultiplexMutex.
-        //=========================================
+        // End of critical area of control_multiplex.
+        //===========================================
 
-        // Release the lock on mMultiplexMutex *first*, before releasing the lock on mState,
-        // to avoid to ever call the try_lock() and fail, while this thread isn't still
-        // BEFORE the critical area of mState!
-
-        mMultiplexMutex.unlock();
+        // Mark that we stop running the loop. Both changes become visible at the same time,
+        // when the lock on the control word is released below, so that no other thread
+        // can ever see control_multiplex set while this thread isn't still BEFORE the
+        // critical area of the control word.
+        mMultiplexThreadId.store(std::thread::id(), std::memory_order_relaxed);
+        control.clear(control_multiplex);
       }
 
-      // Now it is safe to leave the critical area of mState as the try_lock won't fail anymore.
-      // (Or, if we didn't release mMultiplexMutex because keep_looping is true, then this
-      // end of the critical area of mState is equivalent to the first critical area in this
-      // function.
+      // (If we didn't release control_multiplex because keep_looping is true, then this
+      // end of the critical area of the control word is equivalent to the first critical
+      // area in this function.)
 
-      // End of critical area of mState.
-      //================================
+      // End of critical area of the control word.
+      //==========================================
     }
+
+    // Wake up abort() calls that are waiting for the run that just ended.
+    if (AI_UNLIKELY(run_waiter))
+      notify_run_finished();
   }
   while (keep_looping);
 
+  // Pick up the parent that our call back woke up, if it should continue in this thread.
+  boost::intrusive_ptr<AIStatefulTask> parent;
+  if (AI_UNLIKELY(t_continuation.child == this))
+  {
+    t_continuation.child = nullptr;
+    parent.swap(t_continuation.parent);
+  }
+
+  if (AI_UNLIKELY(killed))
+    notify_abort(close_abort_notifications(), false);
+
   if (destruct)
   {
     intrusive_ptr_release(this);
   }
+
+  if (parent)
+  {
+    ++t_continuation_depth;
+    parent->multiplex(continue_run, t_continuation.engine);
+    --t_continuation_depth;
+  }
 }
 
-AIStatefulTask::state_type AIStatefulTask::begin_loop()
+// Mark that this thread is (about to be) calling one of the *_impl() functions
+// and return true when an abort() must be handled before running `state'.
+bool AIStatefulTask::start_run(ControlLock& control, base_state_type state)
 {
-  sub_state_type::wat sub_state_w(mSubState);
-  // Mark that we're about to honor all previous run requests.
-  sub_state_w->need_run = false;
-  // Mark that we're currently not idle and wait() wasn't called (yet).
-  sub_state_w->wait_called = false;
+  // Start of critical area of control_run.
+  control.set(control_run);
+  return (state == bs_multiplex || state == bs_initialize) && control.test(control_aborted);
+}
 
+AIStatefulTask::state_type AIStatefulTask::begin_loop(ControlLock& control)
+{
 #ifdef DEBUG
-  // Mark that we're running the loop.
-  mThreadId = std::this_thread::get_id();
-  // This point marks handling wait() with pending signal().
-  mDebugShouldRun |= mDebugSignalPending;
+  // This point marks handling wait() with pending signal(). A signal() that unblocked the task
+  // did so by setting control_need_run.
+  mDebugShouldRun |= mDebugSignalPending || control.test(control_need_run);
   mDebugSignalPending = false;
 #endif
 
+  // Mark that we're about to honor all previous run requests.
+  control.clear(control_need_run);
+  // Mark that we're currently not idle and wait() wasn't called (yet).
+  control.clear(control_wait_called);
+
   // Make a copy of the state that we're about to run.
-  return sub_state_w->run_state;
+  return mRunState;
 }
 
 void AIStatefulTask::run(AIStatefulTask* parent, condition_type condition, on_abort_st on_abort, AIEngine* default_engine)
@@ -792,30 +985,30 @@ void AIStatefulTask::run(AIStatefulTask* parent, condition_type condition, on_ab
 
 #ifdef DEBUG
   {
-    multiplex_state_type::rat state_r(mState);
+    ControlLock control(this);
     // Can only be run when in one of these states.
-    ASSERT(state_r->base_state == bs_reset || state_r->base_state == bs_finish || state_r->base_state == bs_callback);
+    ASSERT(control.base_state() == bs_reset || control.base_state() == bs_finish || control.base_state() == bs_callback);
     // Must be the first time we're being run, or we must be called from finish_impl or a callback function.
-    ASSERT(!(state_r->base_state == bs_reset && (mParent || mCallback)));
+    ASSERT(!(control.base_state() == bs_reset && (mParent || (rare_ptr() && rare_ptr()->callback))));
   }
 #endif
 
   // Store the requested default engine.
   mDefaultEngine = default_engine;
 
-  // Initialize sleep timer.
-  mSleep = 0;
+  if (rare_ptr())
+  {
+    // Initialize sleep timer.
+    rare_ptr()->sleep = 0;
+  }
 
   // Allow nullptr to be passed as parent to signal that we want to reuse the old one.
   if (parent)
   {
     mParent = parent;
     // In that case remove any old callback!
-    if (mCallback)
-    {
-      delete mCallback;
-      mCallback = nullptr;
-    }
+    if (rare_ptr())
+      rare_ptr()->callback = nullptr;
 
     mParentCondition = condition;
     mOnAbort = on_abort;
@@ -832,44 +1025,53 @@ void AIStatefulTask::run(AIStatefulTask* parent, condition_type condition, on_ab
 
 void AIStatefulTask::run(callback_type::signal_type::slot_type const& slot, AIEngine* default_engine)
 {
-  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::run(<slot>, default_engine = " << default_engine->name() << ") [" << (void*)this << "]");
+  // Adaptor that lets a boost::signals2 slot be stored in an AICompletionCallback.
+  struct signal_callback {
+    std::unique_ptr<callback_type> m_callback;
+    void operator()(bool success) const { m_callback->callback(success); }
+  };
+  run_callback(signal_callback{std::unique_ptr<callback_type>(new callback_type(slot))}, default_engine);
+}
+
+void AIStatefulTask::run_callback(AICompletionCallback&& callback, AIEngine* default_engine)
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::run(<callback>, default_engine = " << default_engine->name() << ") [" << (void*)this << "]");
 
 #ifdef DEBUG
   {
-    multiplex_state_type::rat state_r(mState);
+    ControlLock control(this);
     // Can only be run when in one of these states.
-    ASSERT(state_r->base_state == bs_reset || state_r->base_state == bs_finish || state_r->base_state == bs_callback);
+    ASSERT(control.base_state() == bs_reset || control.base_state() == bs_finish || control.base_state() == bs_callback);
     // Must be the first time we're being run, or we must be called from finish_impl or a callback function.
-    ASSERT(!(state_r->base_state == bs_reset && (mParent || mCallback)));
+    ASSERT(!(control.base_state() == bs_reset && (mParent || (rare_ptr() && rare_ptr()->callback))));
   }
 #endif
 
   // Store the requested default engine.
   mDefaultEngine = default_engine;
 
+  rare_st& rare_fields = rare();
+
   // Initialize sleep timer.
-  mSleep = 0;
+  rare_fields.sleep = 0;
 
-  // Clean up any old callbacks.
+  // Replace any old callbacks.
   mParent = nullptr;
-  if (mCallback)
-  {
-    delete mCallback;
-    mCallback = nullptr;
-  }
-
-  // Create new call back.
-  mCallback = new callback_type(slot);
+  rare_fields.callback = std::move(callback);
 
   // Start from the beginning.
   reset();
 }
 
-void AIStatefulTask::callback()
+void AIStatefulTask::callback(AIEngine* current_engine)
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::callback() [" << (void*)this << "]");
 
-  bool aborted = sub_state_type::rat(mSubState)->aborted;
+  bool aborted = this->aborted();
+  // Let AIWaitTimeouts drop a timeout that is still pending.
+  cancel_timeout();
+  // Take the notifications requested with abort_async() before the call back gets the chance to restart the task.
+  abort_notification_st* abort_notifications = close_abort_notifications();
   if (mParent)
   {
     // It is possible that the parent is not running when the parent is in fact aborting and called
@@ -884,18 +1086,25 @@ void AIStatefulTask::callback()
       }
       else if (!aborted || mOnAbort == signal_parent)
       {
-        mParent->signal(mParentCondition);
+        if (t_continuation_depth < sMaxContinuationDepth && !t_continuation.child)
+          mParent->signal_continuation(mParentCondition, this, current_engine);
+        else
+          mParent->signal(mParentCondition);
       }
     }
   }
-  if (mCallback)
+  if (rare_ptr() && rare_ptr()->callback)
   {
-    mCallback->callback(!aborted);
-    if (multiplex_state_type::rat(mState)->base_state != bs_reset)
-    {
-      delete mCallback;
-      mCallback = nullptr;
+    // Move the call back out of the way while calling it, because it might call run() with a new one.
+    AICompletionCallback callback(std::move(rare_ptr()->callback));
+    callback(!aborted);
+    // The base state is still bs_callback here; a call to run() (not followed by kill()) is marked by control_reset.
+    if (!(mControl.load(std::memory_order_acquire) & control_reset))
       mParent = nullptr;
+    else if (!mParent && !rare_ptr()->callback)
+    {
+      // Restarted with run() without arguments: keep the same call back.
+      rare_ptr()->callback = std::move(callback);
     }
   }
   else
@@ -903,6 +1112,8 @@ void AIStatefulTask::callback()
     // Not restarted by callback. Allow run() to be called later on.
     mParent = nullptr;
   }
+  if (AI_UNLIKELY(abort_notifications))
+    notify_abort(abort_notifications, !aborted);
 }
 
 void AIStatefulTask::initialize_impl()
@@ -924,23 +1135,22 @@ void AIStatefulTask::finish_impl()
 
 void AIStatefulTask::force_killed()
 {
-  multiplex_state_type::wat(mState)->base_state = bs_killed;
+  ControlLock(this).set_base_state(bs_killed);
+  // A task that is killed while it still has a pending timeout can be destroyed without passing callback().
+  cancel_timeout();
 }
 
 void AIStatefulTask::kill()
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::kill() [" << (void*)this << "]");
 #ifdef DEBUG
-  {
-    multiplex_state_type::rat state_r(mState);
-    // kill() may only be called from the call back function.
-    ASSERT(state_r->base_state == bs_callback);
-    // May only be called by the thread that is holding mMultiplexMutex.
-    ASSERT(mThreadId == std::this_thread::get_id());
-  }
+  // kill() may only be called from the call back function.
+  ASSERT((mControl.load(std::memory_order_relaxed) & control_base_state_mask) == bs_callback);
+  // May only be called by the thread that owns the task.
+  ASSERT(executing());
 #endif
   // Void last call to run() (ie from finish_impl()), if any.
-  sub_state_type::wat(mSubState)->reset = false;
+  ControlLock(this).clear(control_reset);
 }
 
 void AIStatefulTask::reset()
@@ -953,24 +1163,26 @@ void AIStatefulTask::reset()
   mDebugRefCalled = false;
 #endif
   mDuration = AIEngine::duration_type::zero();
+  if (rare_ptr())
+    rare_ptr()->timed_out = false;
+  // Accept new requests from abort_async() again (keeping the ones done before the first run).
+  abort_notification_st* closed = abort_notifications_closed();
+  mAbortNotifications.compare_exchange_strong(closed, nullptr, std::memory_order_relaxed);
   bool inside_multiplex;
   {
-    multiplex_state_type::rat state_r(mState);
+    ControlLock control(this);
     // reset() is only called from run(), which may only be called when just created, from finish_impl() or from the call back function.
-    ASSERT(state_r->base_state == bs_reset || state_r->base_state == bs_finish || state_r->base_state == bs_callback);
-    inside_multiplex = state_r->base_state != bs_reset;
-  }
-  {
-    sub_state_type::wat sub_state_w(mSubState);
+    ASSERT(control.base_state() == bs_reset || control.base_state() == bs_finish || control.base_state() == bs_callback);
+    inside_multiplex = control.base_state() != bs_reset;
     // Reset.
-    sub_state_w->aborted = sub_state_w->finished = false;
+    control.clear(control_aborted | control_finished);
     // Signal that we want to start running from the beginning.
-    sub_state_w->reset = true;
+    control.set(control_reset);
     // We're not waiting for a condition.
-    sub_state_w->idle = 0;
-    sub_state_w->busy = ~sub_state_w->idle;
+    control.set_idle(0);
+    mBusy = ~control.idle();
     // Keep running till we reach at least bs_multiplex.
-    sub_state_w->need_run = true;
+    control.set(control_need_run);
   }
   if (!inside_multiplex)
   {
@@ -984,69 +1196,98 @@ void AIStatefulTask::set_state(state_type new_state)
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::set_state(" << state_str_impl(new_state) << ") [" << (void*)this << "]");
 #ifdef DEBUG
   {
-    multiplex_state_type::rat state_r(mState);
+    ControlLock control(this);
     // set_state() may only be called from initialize_impl() or multiplex_impl().
-    ASSERT(state_r->base_state == bs_initialize || state_r->base_state == bs_multiplex);
-    // May only be called by the thread that is holding mMultiplexMutex.
-    ASSERT(mThreadId == std::this_thread::get_id());
-  }
-#endif
-  {
-    sub_state_type::wat sub_state_w(mSubState);
+    ASSERT(control.base_state() == bs_initialize || control.base_state() == bs_multiplex);
+    // May only be called by the thread that owns the task.
+    ASSERT(executing());
     // It should never happen that set_state() is called while we're idle,
     // unless we just called wait(). It is ok/allowed to call set_state
     // after a call to wait() to set the state we want to continue after
     // receiving a signal().
-    ASSERT(sub_state_w->wait_called || !sub_state_w->idle);
-    // Force current state to the requested state.
-    sub_state_w->run_state = new_state;
-#ifdef DEBUG
+    ASSERT(control.test(control_wait_called) || !control.idle());
     // We should run. This can only be cancelled by a call to wait().
-    mDebugSetStatePending = !sub_state_w->wait_called;
-#endif
+    mDebugSetStatePending = !control.test(control_wait_called);
   }
+#endif
+  // Force current state to the requested state.
+  // The run state is only accessed by the thread that owns the task, so this doesn't need a lock.
+  mRunState = new_state;
+  AITrace::task_event(AITrace::task_set_state, this, new_state);
 }
 
 void AIStatefulTask::wait(condition_type conditions)
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::wait(" << std::hex << conditions << std::dec << ") [" << (void*)this << "]");
+  // May only be called by the thread that owns the task.
+  ASSERT(executing());
 #ifdef DEBUG
-  {
-    multiplex_state_type::rat state_r(mState);
-    // wait() may only be called multiplex_impl().
-    ASSERT(state_r->base_state == bs_multiplex);
-    // May only be called by the thread that is holding mMultiplexMutex.
-    ASSERT(mThreadId == std::this_thread::get_id());
-  }
   // wait() following set_state() cancels the reason to run because of the call to set_state.
   mDebugSetStatePending = false;
 #endif
+  // Not sleeping (anymore).
+  if (rare_ptr())
+    rare_ptr()->sleep = 0;
+
+  AITrace::task_event(AITrace::task_wait, this, conditions);
+
   {
-    sub_state_type::wat sub_state_w(mSubState);
+    ControlLock control(this);
+    // wait() may only be called multiplex_impl().
+    ASSERT(control.base_state() == bs_multiplex);
     // As wait() may only be called from within the stateful task, it should never happen that the task is already idle.
-    ASSERT(!sub_state_w->idle);
+    ASSERT(!control.idle());
     // Mark that we at least attempted to go idle.
-    sub_state_w->wait_called = true;
+    control.set(control_wait_called);
 
     // Determine if we must go idle.
 
     // Copy bits from skip_wait to busy.
-    sub_state_w->busy &= ~conditions;     				// Reset the masked bit.
-    sub_state_w->busy |= sub_state_w->skip_wait & conditions;           // Then set the masked bit if it is set in skip_wait.
+    mBusy &= ~conditions;                       // Reset the masked bit.
+    mBusy |= mSkipWait & conditions;            // Then set the masked bit if it is set in skip_wait.
     // Reset the masked bit in skip_wait.
-    sub_state_w->skip_wait &= ~conditions;
+    mSkipWait &= ~conditions;
     // Mark that we are waiting for the condition corresponding to conditions.
-    sub_state_w->idle = ~sub_state_w->busy & conditions;
+    control.set_idle(~mBusy & conditions);
 
-    // Not sleeping (anymore).
-    mSleep = 0;
 #ifdef DEBUG
     // From this moment.
-    mDebugSignalPending = !sub_state_w->idle;
+    mDebugSignalPending = !control.idle();
 #endif
   }
 }
 
+// Update busy and skip_wait for a call to signal(condition) and, if the task is idle for any of the bits
+// in condition, unblock it: clear the idle mask and mark that a re-entry of multiplex() is necessary.
+// Returns true if this thread unblocked the task, in which case it is responsible for scheduling it
+// (unless it is running the task).
+//
+// The masks and the idle state are changed in a single critical area of the control word, so that
+// the uncontended case costs one compare-and-swap (taking control_locked) and one store.
+bool AIStatefulTask::unblock(condition_type condition)
+{
+  ControlLock control(this);
+  // Copy bits from busy to skip_wait.
+  mSkipWait &= ~condition;                      // Reset the masked bits.
+  mSkipWait |= mBusy & condition;               // Then set masked bits that are set in busy.
+  // Set the masked bits in busy;
+  mBusy |= condition;
+  // Test if we are idle or not.
+  if (!(control.idle() & condition))
+  {
+    Dout(dc::statefultask(mSMDebug), "Ignoring because idle == " << std::hex << control.idle() << std::dec);
+    return false;
+  }
+  // The wake-up latency is measured from here (see AIWakeUpLatency).
+  // Releasing control_locked publishes the time to the thread that will run the task.
+  mSignalTicks.store(AITaskAccounting::now(), std::memory_order_relaxed);
+  // Unblock this task.
+  control.set_idle(0);
+  // Mark that a re-entry of multiplex() is necessary.
+  control.set(control_need_run);
+  return true;
+}
+
 // Go idle until wait_condition() becomes true. For this to work, signal(condition) must be called
 // each time that something changed that might cause wait_condition() to become true, most notably
 // signal(condition) must be called at least once after wait_condition() has become true.
@@ -1054,11 +1295,100 @@ void AIStatefulTask::wait_until(std::function<bool()> const& wait_condition, con
 {
   if (!wait_condition())
   {
-    {
-      multiplex_state_type::wat state_w(mState);
-      state_w->wait_condition = wait_condition;
-      state_w->conditions = conditions;
-    }
+    // Only accessed by the thread that owns the task.
+    rare_st& rare_fields = rare();
+    rare_fields.wait_condition_func = wait_condition;
+    rare_fields.wait_condition = [](void* context){ return (*static_cast<AIWaitConditionFunc*>(context))(); };
+    rare_fields.wait_condition_context = &rare_fields.wait_condition_func;
+    rare_fields.wait_conditions = conditions;
+    wait(conditions);
+  }
+}
+
+void AIStatefulTask::wait(condition_type conditions, std::chrono::steady_clock::duration timeout)
+{
+  wait(conditions);
+  // Only arm the timeout when we actually went idle; otherwise we run again right away.
+  if ((mControl.load(std::memory_order_relaxed) & control_idle_mask))
+    arm_timeout(clock_type::now() + timeout, conditions);
+}
+
+void AIStatefulTask::wait_until(AIWaitConditionFunc const& wait_condition, condition_type conditions, std::chrono::steady_clock::duration timeout)
+{
+  wait_until(wait_condition, conditions);
+  if (rare_ptr() && rare_ptr()->wait_condition)   // Are we waiting?
+    arm_timeout(clock_type::now() + timeout, conditions);
+}
+
+void AIStatefulTask::wait_until(AIWaitConditionPtr wait_condition, void* context, condition_type conditions, std::chrono::steady_clock::duration timeout)
+{
+  wait_until(wait_condition, context, conditions);
+  if (rare_ptr() && rare_ptr()->wait_condition)   // Are we waiting?
+    arm_timeout(clock_type::now() + timeout, conditions);
+}
+
+// Register a timeout with AIWaitTimeouts that signals the task at deadline, unless the task runs before that (see end_timeout()).
+// The signal uses the bits of conditions that the task is idle on at that moment (see timeout_expired()).
+void AIStatefulTask::arm_timeout(clock_type::time_point deadline, condition_type conditions)
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::arm_timeout(" << std::hex << conditions << std::dec << ") [" << (void*)this << "]");
+  // May only be called by the thread that owns the task.
+  ASSERT(executing());
+  // It is not allowed to wait on an empty mask.
+  ASSERT(conditions);
+  rare_st& rare_fields = rare();
+  uint32_t const old_state = rare_fields.timeout_state.load(std::memory_order_relaxed);
+  // A timeout that is still pending is replaced by add(); the new generation makes sure that it doesn't fire anymore if it is being expired right now.
+  uint32_t const generation = ((old_state >> timeout_generation_shift) + 1) & (~static_cast<uint32_t>(0) >> timeout_generation_shift);
+  rare_fields.timeout_state.store(generation << timeout_generation_shift | timeout_pending, std::memory_order_release);
+  AIWaitTimeouts::add(deadline, this, generation, conditions);
+}
+
+// Cancel the pending timeout, if any, and set timed_out to whether or not it fired before it was cancelled.
+bool AIStatefulTask::end_timeout()
+{
+  uint32_t const old_state = rare_ptr()->timeout_state.fetch_and(~(timeout_pending | timeout_fired), std::memory_order_acq_rel);
+  bool const fired = old_state & timeout_fired;
+  if ((old_state & timeout_pending) && !fired)
+    remove_timeout();
+  rare_ptr()->timed_out = fired;
+  Dout(dc::statefultask(mSMDebug && fired), "Timed out [" << (void*)this << "]");
+  return fired;
+}
+
+// Called by the thread of AIWaitTimeouts when the deadline of a timeout passed.
+bool AIStatefulTask::timeout_expired(uint32_t generation, condition_type conditions)
+{
+  uint32_t pending_state = generation << timeout_generation_shift | timeout_pending;
+  // Fails when the task ran since (or started waiting with a new timeout).
+  if (!rare_ptr()->timeout_state.compare_exchange_strong(pending_state, pending_state | timeout_fired, std::memory_order_acq_rel, std::memory_order_relaxed))
+    return false;
+  // Only signal bits that the task is idle on: wait() may not have gone idle on all of the bits passed to it,
+  // and signalling a busy bit would do nothing (or cause an extra run later on).
+  condition_type const idle = (mControl.load(std::memory_order_acquire) >> control_idle_shift) & conditions;
+  // Never run the task in this thread: that would delay every other timeout until the run returned.
+  if (idle)
+    signal_deferred(idle);
+  return true;
+}
+
+// Remove the entry of this task from the heap of AIWaitTimeouts, so that it doesn't linger there until its deadline.
+void AIStatefulTask::remove_timeout()
+{
+  AIWaitTimeouts::remove(this);
+}
+
+// Same as above, but without the need to construct (and copy) a std::function.
+// The condition is evaluated as wait_condition(context) by the thread that runs the task, without any lock.
+void AIStatefulTask::wait_until(AIWaitConditionPtr wait_condition, void* context, condition_type conditions)
+{
+  if (!wait_condition(context))
+  {
+    // Only accessed by the thread that owns the task.
+    rare_st& rare_fields = rare();
+    rare_fields.wait_condition = wait_condition;
+    rare_fields.wait_condition_context = context;
+    rare_fields.wait_conditions = conditions;
     wait(conditions);
   }
 }
@@ -1071,102 +1401,192 @@ bool AIStatefulTask::signal(condition_type condition)
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::signal(" << std::hex << condition << std::dec << ") [" << (void*)this << "]");
   // It is not allowed to call this function with an empty mask.
   ASSERT(condition);
+  AITrace::task_event(AITrace::task_signal, this, condition);
+  // Only the thread that flips the task from idle to runnable goes on to schedule it.
+  if (!unblock(condition))
+    return false;
+  if (!executing())
+    multiplex(schedule_run);
+  return true;
+}
+
+// Same as signal(), but a task without engine is added to an engine instead of being run by the calling thread.
+bool AIStatefulTask::signal_deferred(condition_type condition, AIEngine* engine)
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::signal_deferred(" << std::hex << condition << std::dec << ", " << (engine ? engine->name() : "nullptr") << ") [" << (void*)this << "]");
+  ASSERT(condition);
+  AITrace::task_event(AITrace::task_signal, this, condition);
+  if (!unblock(condition))
+    return false;
+  if (!executing())
+    multiplex(deferred_run, engine);
+  return true;
+}
+
+void AIStatefulTask::defer_signals(AIEngine* engine)
+{
+  rare_st& rare_fields = rare();
+  rare_fields.defer_signals = true;
+  rare_fields.signal_engine = engine;
+}
+
+void AIStatefulTask::inline_signals()
+{
+  if (rare_ptr())
+  {
+    rare_ptr()->defer_signals = false;
+    rare_ptr()->signal_engine = nullptr;
+  }
+}
+
+// Called by a child task from callback(), instead of signal(condition), when continuations are enabled.
+// If this unblocks the task then, instead of scheduling a run right away, it is run by the thread
+// of the child as soon as the child's multiplex() returns (see multiplex()).
+void AIStatefulTask::signal_continuation(condition_type condition, AIStatefulTask const* child, AIEngine* engine)
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::signal_continuation(" << std::hex << condition << std::dec << ", " << (void*)child << ") [" << (void*)this << "]");
+  ASSERT(condition);
+  if (!unblock(condition) || executing())
+    return;
+  t_continuation.child = child;
+  t_continuation.parent = this;
+  t_continuation.engine = engine;
+}
+
+void AIStatefulTask::abort()
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::abort() [" << (void*)this << "]");
+  abort_async();
+  // Block until the current run finished (unless that is us).
+  if (!executing() && (mControl.load(std::memory_order_acquire) & control_run))
   {
-    sub_state_type::wat sub_state_w(mSubState);
-    // Copy bits from busy to skip_wait.
-    sub_state_w->skip_wait &= ~condition;                       // Reset the masked bits.
-    sub_state_w->skip_wait |= sub_state_w->busy & condition;	// Then set masked bits that are set in busy.
-    // Set the masked bits in busy;
-    sub_state_w->busy |= condition;
-    // Test if we are idle or not.
-    if (!(sub_state_w->idle & condition))
+    Dout(dc::warning, "AIStatefulTask::abort() blocks because the stateful task is still executing code in another thread.");
+    std::unique_lock<std::mutex> lock(s_run_finished_mutex);
     {
-      Dout(dc::statefultask(mSMDebug), "Ignoring because idle == " << std::hex << sub_state_w->idle << std::dec);
-      return false;
+      ControlLock control(this);
+      if (control.test(control_run))
+        control.set(control_run_waiter);
     }
+    // Done when the run ended: control_run_waiter is cleared together with control_run. If a new run started
+    // in the meantime and another abort() set control_run_waiter again, then we just wait for that one too.
+    s_run_finished.wait(lock, [this](){
+        uint64_t const control = mControl.load(std::memory_order_acquire);
+        return (control & (control_run | control_run_waiter)) != (control_run | control_run_waiter);
+    });
+  }
 #ifdef DEBUG
-    mDebugSignalPending = sub_state_w->wait_called;
+  // When abort() returns, it may never run again.
+  mDebugAborted = true;
 #endif
-    // Unblock this task.
-    sub_state_w->idle = 0;
-    // Mark that a re-entry of multiplex() is necessary.
-    sub_state_w->need_run = true;
-  }
-  if (!mMultiplexMutex.self_locked())
-    multiplex(schedule_run);
-  return true;
 }
 
-void AIStatefulTask::abort()
+void AIStatefulTask::abort_async()
 {
-  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::abort() [" << (void*)this << "]");
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::abort_async() [" << (void*)this << "]");
   bool is_waiting = false;
   {
-    multiplex_state_type::rat state_r(mState);
-    sub_state_type::wat sub_state_w(mSubState);
+    ControlLock control(this);
     // Mark that we are aborted, iff we didn't already finish.
-    sub_state_w->aborted = !sub_state_w->finished;
+    if (control.test(control_finished))
+      control.clear(control_aborted);
+    else
+      control.set(control_aborted);
+    // Schedule a new run when this task is waiting.
+    is_waiting = control.base_state() == bs_multiplex && control.idle();
     // No longer say we woke up when signal() is called.
-    if (sub_state_w->idle)
+    if (control.idle())
     {
-      Dout(dc::statefultask(mSMDebug), "Removing block on mask " << std::hex << sub_state_w->idle << std::dec);
-      sub_state_w->idle = 0;
+      Dout(dc::statefultask(mSMDebug), "Removing block on mask " << std::hex << control.idle() << std::dec);
+      control.set_idle(0);
     }
     // Mark that a re-entry of multiplex() is necessary.
-    sub_state_w->need_run = true;
-    // Schedule a new run when this task is waiting.
-    is_waiting = state_r->base_state == bs_multiplex && sub_state_w->idle;
+    control.set(control_need_run);
   }
-  if (is_waiting && !mMultiplexMutex.self_locked())
+  // If the task is waiting, this switches it to bs_abort and adds it to its engine (and only handles the abort
+  // in this thread if the task has no engine). If another thread is executing the task, then that thread
+  // picks up control_need_run when it leaves multiplex_impl() and handles the abort.
+  if (is_waiting && !executing())
     multiplex(insert_abort);
-  // Block until the current run finished.
-  if (!mRunMutex.try_lock())
+}
+
+void AIStatefulTask::abort_async(AIStatefulTask* waiter, condition_type condition)
+{
+  boost::intrusive_ptr<AIStatefulTask> task(waiter);
+  abort_async_notify(AICompletionCallback([task, condition](bool){ task->signal(condition); }));
+}
+
+void AIStatefulTask::abort_async_notify(AICompletionCallback&& callback)
+{
+  DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::abort_async_notify() [" << (void*)this << "]");
+  // Request the notification before marking the abort, so that it can't be missed.
+  abort_notification_st* notification = new abort_notification_st(std::move(callback));
+  abort_notification_st* head = mAbortNotifications.load(std::memory_order_relaxed);
+  do
   {
-    Dout(dc::warning, "AIStatefulTask::abort() blocks because the stateful task is still executing code in another thread.");
-    mRunMutex.lock();
+    if (head == abort_notifications_closed())
+    {
+      // The task already finished and called its call back; there is nothing left to abort.
+      notify_abort(notification, !aborted());
+      return;
+    }
+    notification->next = head;
+  }
+  while (!mAbortNotifications.compare_exchange_weak(head, notification, std::memory_order_release, std::memory_order_relaxed));
+  abort_async();
+}
+
+AIStatefulTask::abort_notification_st* AIStatefulTask::close_abort_notifications()
+{
+  abort_notification_st* list = mAbortNotifications.exchange(abort_notifications_closed(), std::memory_order_acquire);
+  return list == abort_notifications_closed() ? nullptr : list;
+}
+
+//static
+void AIStatefulTask::notify_abort(abort_notification_st* list, bool success)
+{
+  // Reverse the list, so that notifications are given in the order in which they were requested.
+  abort_notification_st* reversed = nullptr;
+  while (list)
+  {
+    abort_notification_st* next = list->next;
+    list->next = reversed;
+    reversed = list;
+    list = next;
+  }
+  while (reversed)
+  {
+    abort_notification_st* next = reversed->next;
+    reversed->callback(success);
+    delete reversed;
+    reversed = next;
   }
-  mRunMutex.unlock();
-#ifdef DEBUG
-  // When abort() returns, it may never run again.
-  mDebugAborted = true;
-#endif
 }
 
 void AIStatefulTask::finish()
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::finish() [" << (void*)this << "]");
-#ifdef DEBUG
+  // May only be called by the thread that owns the task.
+  ASSERT(executing());
   {
-    multiplex_state_type::rat state_r(mState);
+    ControlLock control(this);
     // finish() may only be called from multiplex_impl().
-    ASSERT(state_r->base_state == bs_multiplex);
-    // May only be called by the thread that is holding mMultiplexMutex.
-    ASSERT(mThreadId == std::this_thread::get_id());
-  }
-#endif
-  {
-    sub_state_type::wat sub_state_w(mSubState);
+    ASSERT(control.base_state() == bs_multiplex);
     // finish() should not be called when idle.
-    ASSERT(!sub_state_w->idle);
+    ASSERT(!control.idle());
     // But reset idle to stop subsequent calls to signal() from calling multiplex().
-    sub_state_w->idle = 0;
+    control.set_idle(0);
     // Mark that we are finished.
-    sub_state_w->finished = true;
+    control.set(control_finished);
   }
 }
 
 void AIStatefulTask::yield()
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::yield() [" << (void*)this << "]");
-#ifdef DEBUG
-  {
-    multiplex_state_type::rat state_r(mState);
-    // yield() may only be called from multiplex_impl().
-    ASSERT(state_r->base_state == bs_multiplex);
-    // May only be called by the thread that is holding mMultiplexMutex.
-    ASSERT(mThreadId == std::this_thread::get_id());
-  }
-#endif
+  // yield() may only be called from multiplex_impl().
+  ASSERT((mControl.load(std::memory_order_relaxed) & control_base_state_mask) == bs_multiplex);
+  // May only be called by the thread that owns the task.
+  ASSERT(executing());
   // Indicate we should leave mainloop().
   mYield = true;
 }
@@ -1174,14 +1594,11 @@ void AIStatefulTask::yield()
 void AIStatefulTask::target(AIEngine* engine)
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::target(" << (engine ? engine->name() : "nullptr") << ") [" << (void*)this << "]");
-#ifdef DEBUG
-  {
-    multiplex_state_type::rat state_r(mState);
-    // May only be called by the thread that is holding mMultiplexMutex.
-    ASSERT(mThreadId == std::this_thread::get_id());
-  }
-#endif
-  mTargetEngine = engine;
+  // May only be called by the thread that owns the task.
+  ASSERT(executing());
+  // Don't allocate the rare fields just to store a nullptr.
+  if (engine || rare_ptr())
+    rare().target_engine = engine;
 }
 
 void AIStatefulTask::yield(AIEngine* engine)
@@ -1194,7 +1611,7 @@ void AIStatefulTask::yield(AIEngine* engine)
 
 bool AIStatefulTask::yield_if_not(AIEngine* engine)
 {
-  if (engine && multiplex_state_type::rat(mState)->current_engine != engine)
+  if (engine && mCurrentEngine.load(std::memory_order_relaxed) != engine)
   {
     yield(engine);
     return true;
@@ -1205,7 +1622,7 @@ bool AIStatefulTask::yield_if_not(AIEngine* engine)
 void AIStatefulTask::yield_frame(unsigned int frames)
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::yield_frame(" << frames << ") [" << (void*)this << "]");
-  mSleep = -static_cast<AIEngine::clock_type::rep>(frames);       // Frames are stored as a negative number.
+  rare().sleep = -static_cast<AIEngine::clock_type::rep>(frames);       // Frames are stored as a negative number.
   // Sleeping is always done from the main thread.
   yield(&gMainThreadEngine);
 }
@@ -1214,7 +1631,7 @@ void AIStatefulTask::yield_ms(unsigned int ms)
 {
   DoutEntering(dc::statefultask(mSMDebug), "AIStatefulTask::yield_ms(" << ms << ") [" << (void*)this << "]");
   AIEngine::duration_type sleep_duration = std::chrono::duration_cast<AIEngine::duration_type>(std::chrono::duration<unsigned int, std::milli>(ms));
-  mSleep = (AIEngine::clock_type::now() + sleep_duration).time_since_epoch().count();
+  rare().sleep = (AIEngine::clock_type::now() + sleep_duration).time_since_epoch().count();
   // Sleeping is always done from the main thread.
   yield(&gMainThreadEngine);
 }
@@ -1235,6 +1652,37 @@ char const* AIStatefulTask::state_str(base_state_type state)
   return "UNKNOWN BASE STATE";
 }
 
+// Print the memory footprint of a task, per component. The sum of the components can be less than
+// the total because of padding; the last two entries are only allocated when they are used.
+void AIStatefulTask::print_sizeof_on(std::ostream& os)
+{
+  auto line = [&os](char const* component, size_t size) { os << "  " << std::setw(40) << std::left << component << std::right << std::setw(4) << size << '\n'; };
+  os << "sizeof(AIStatefulTask) = " << sizeof(AIStatefulTask) << '\n';
+  line("AIRefCount (including vtable pointer)", sizeof(AIRefCount));
+  line("mRunState", sizeof(mRunState));
+  line("mControl", sizeof(mControl));
+  line("mBusy", sizeof(mBusy));
+  line("mSkipWait", sizeof(mSkipWait));
+  line("mCurrentEngine", sizeof(mCurrentEngine));
+  line("mMultiplexThreadId", sizeof(mMultiplexThreadId));
+  line("mParent", sizeof(mParent));
+  line("mRare", sizeof(mRare));
+  line("mAbortNotifications", sizeof(mAbortNotifications));
+  line("mDefaultEngine", sizeof(mDefaultEngine));
+  line("mParentCondition, mOnAbort, mYield, mPriority, mAffinity", sizeof(mParentCondition) + sizeof(mOnAbort) + sizeof(mYield) + sizeof(mPriority) + sizeof(mAffinity));
+#ifdef DEBUG
+  line("debug fields", sizeof(mDebugShouldRun) + sizeof(mDebugAborted) + sizeof(mDebugSignalPending) +
+      sizeof(mDebugSetStatePending) + sizeof(mDebugRefCalled) + sizeof(mDebugLastState));
+#endif
+#ifdef CWDEBUG
+  line("mSMDebug", sizeof(mSMDebug));
+#endif
+  line("mDuration", sizeof(mDuration));
+  line("mSignalTicks", sizeof(mSignalTicks));
+  line("rare_st (wait_until, yield_*, call back)", sizeof(rare_st));
+  line("callback_type (run with a signals2 slot)", sizeof(callback_type));
+}
+
 #ifdef CWDEBUG
 NAMESPACE_DEBUG_CHANNELS_START
 channel_ct statefultask("STATEFULTASK");
@@ -39,11 +39,16 @@
 #include "utils/AIRefCount.h"
 #include "utils/macros.h"
 #include "threadsafe/aithreadsafe.h"
-#include "threadsafe/AIMutex.h"
 #include "debug.h"
+#include "AICompletionCallback.h"
 #include <list>
+#include <atomic>
 #include <chrono>
+#include <thread>
+#include <cstdint>
 #include <functional>
+#include <type_traits>
+#include <iosfwd>
 #include <boost/signals2.hpp>
 
 class AICondition;
@@ -53,6 +58,7 @@ extern AIEngine gMainThreadEngine;
 extern AIEngine gAuxiliaryThreadEngine;
 
 using AIWaitConditionFunc = std::function<bool()>;
+using AIWaitConditionPtr = bool (*)(void* context);     // Allocation free alternative to AIWaitConditionFunc, see wait_until().
 
 class AIStatefulTask : public AIRefCount
 {
@@ -66,9 +72,11 @@ class AIStatefulTask : public AIRefCount
       initial_run,
       schedule_run,
       normal_run,
-      insert_abort
+      insert_abort,
+      continue_run,             // Run directly by the thread that just finished a child task (see setMaxContinuationDepth).
+      deferred_run              // Like schedule_run, but don't run in the calling thread (see signal_deferred()).
     };
-    // The type of mState
+    // The type of the base state.
     enum base_state_type {
       bs_reset,                 // Idle state before run() is called. Reference count is zero (except for a possible external boost::intrusive_ptr).
       bs_initialize,            // State after run() and before/during initialize_impl().
@@ -78,57 +86,80 @@ class AIStatefulTask : public AIRefCount
       bs_callback,
       bs_killed
     };
+    // The base state is stored in the lower three bits of mControl.
+    static_assert(bs_killed < 8, "base_state_type doesn't fit in control_base_state_mask");
   public:
     static state_type const max_state = bs_killed + 1;
-    enum on_abort_st { abort_parent, signal_parent, do_nothing };
+    enum on_abort_st : uint8_t { abort_parent, signal_parent, do_nothing };
+    // The priority class of a task. Engines run runnable tasks of a higher class first and
+    // AIPackagedTask::dispatch() passes the class of the parent task on to the thread pool.
+    enum priority_type : uint8_t { high_priority, normal_priority, low_priority };
+    static int const number_of_priorities = low_priority + 1;
 
-  protected:
-    struct multiplex_state_st {
-      base_state_type base_state;
-      AIEngine* current_engine;         // Current engine.
-      AIWaitConditionFunc wait_condition;
-      condition_type conditions;
-      multiplex_state_st() : base_state(bs_reset), current_engine(nullptr), wait_condition(nullptr) { }
+  private:
+    // The bits of mControl.
+    //
+    // The base state, the sub state flags, the idle mask and the ownership of the task
+    // are all stored in a single atomic word, so that they can be tested and changed
+    // together with a single atomic operation.
+    enum control_bits : uint64_t {
+      control_base_state_mask = 0x7,    // The base_state_type.
+      control_reset = 0x8,              // run() was called from finish_impl() or the call back (and kill() wasn't called).
+      control_need_run = 0x10,          // A re-entry of multiplex() is necessary.
+      control_wait_called = 0x20,       // wait() was called since the last call to begin_loop().
+      control_aborted = 0x40,           // abort() was called (and the task didn't finish before that).
+      control_finished = 0x80,          // finish() was called, or the task was aborted.
+      control_multiplex = 0x100,        // A thread is running multiplex() and owns the task (formerly mMultiplexMutex).
+      control_run = 0x200,              // A thread is calling one of the *_impl() functions or the call back (formerly mRunMutex).
+      control_locked = 0x400,           // Lock bit: the control word and the masks mBusy and mSkipWait are being changed (formerly mState and mSubState).
+      control_run_waiter = 0x800,       // abort() is blocked until the current run finished (cleared, with a notification, when control_run is cleared).
+      control_idle_mask = 0xffffffff00000000    // The idle state at the end of the last call to wait(conditions) (~busy & conditions).
     };
-    struct sub_state_st {
-      condition_type busy;              //!< Each bit represents being not-idle for that condition-bit: wait(condition_bit) was never called or signal(condition_bit) was called last.
-      condition_type skip_wait;         //!< Each bit represents having been signalled ahead of the call to wait(condition_bit) for that condition-bit: signal(condition_bit) was called while already busy.
-      condition_type idle;              //!< A the idle state at the end of the last call to wait(conditions) (~busy & conditions).
-      state_type run_state;
-      bool reset;
-      bool need_run;
-      bool wait_called;
-      bool aborted;
-      bool finished;
+    static int const control_idle_shift = 32;
+
+    // Scoped lock on the control word.
+    //
+    // All changes to mControl (other than those made with the lock bit) are made while holding
+    // the lock bit, so the copy in m_control is authoritative until it is written back upon destruction.
+    class ControlLock {
+      private:
+        AIStatefulTask const* m_task;
+        uint64_t m_control;
+
+      public:
+        ControlLock(AIStatefulTask const* task) : m_task(task), m_control(task->lock_control()) { }
+        ~ControlLock() { m_task->mControl.store(m_control, std::memory_order_release); }
+        ControlLock(ControlLock const&) = delete;
+
+        base_state_type base_state() const { return static_cast<base_state_type>(m_control & control_base_state_mask); }
+        void set_base_state(base_state_type base_state) { m_control = (m_control & ~static_cast<uint64_t>(control_base_state_mask)) | base_state; }
+        bool test(uint64_t bits) const { return m_control & bits; }
+        void set(uint64_t bits) { m_control |= bits; }
+        void clear(uint64_t bits) { m_control &= ~bits; }
+        condition_type idle() const { return m_control >> control_idle_shift; }
+        void set_idle(condition_type idle) { m_control = (m_control & ~static_cast<uint64_t>(control_idle_mask)) | (static_cast<uint64_t>(idle) << control_idle_shift); }
     };
 
-  private:
-    // Base state.
-    using multiplex_state_type = aithreadsafe::Wrapper<multiplex_state_st, aithreadsafe::policy::Primitive<std::mutex>>;
-    multiplex_state_type mState;
+    // Only accessed by the thread that owns the task. Declared first so that it fits in the tail padding of AIRefCount.
+    state_type mRunState;
 
-  protected:
-    // Sub state.
-    using sub_state_type = aithreadsafe::Wrapper<sub_state_st, aithreadsafe::policy::Primitive<std::mutex>>;
-    sub_state_type mSubState;
+    mutable std::atomic<uint64_t> mControl;     // See control_bits.
 
-  private:
-    // Mutex protecting everything below and making sure only one thread runs the task at a time.
-    AIMutex mMultiplexMutex;
-    // Mutex that is locked while calling *_impl() functions and the call back.
-    std::recursive_mutex mRunMutex;
+    // Protected by control_locked. These are changed together with the idle mask, in the same critical area.
+    condition_type mBusy;               // Each bit represents being not-idle for that condition-bit: wait(condition_bit) was never called or signal(condition_bit) was called last.
+    condition_type mSkipWait;           // Each bit represents having been signalled ahead of the call to wait(condition_bit) for that condition-bit: signal(condition_bit) was called while already busy.
+
+    // Changed while holding control_locked, but may be read at any time.
+    std::atomic<AIEngine*> mCurrentEngine;              // Current engine.
+    std::atomic<std::thread::id> mMultiplexThreadId;    // The thread that owns the task (has control_multiplex set), or std::thread::id() when none.
 
     using clock_type = std::chrono::steady_clock;
     using duration_type = clock_type::duration;
 
-    clock_type::rep mSleep;   //!< Non-zero while the task is sleeping. Negative means frames, positive means clock periods.
-
     // Callback facilities.
     // From within an other stateful task:
     boost::intrusive_ptr<AIStatefulTask> mParent;       // The parent object that started this task, or nullptr if there isn't any.
-    condition_type mParentCondition;                    // The condition (bit) that the parent should be signalled with upon a successful finish.
-    on_abort_st mOnAbort;                               // What to do with the parent (if any) when aborted.
-    // From outside a stateful task:
+    // From outside a stateful task (see run(F&&) and run(slot_type const&)):
     struct callback_type {
       using signal_type = boost::signals2::signal<void (bool)>;
       callback_type(signal_type::slot_type const& slot) { connection = signal.connect(slot); }
@@ -138,40 +169,92 @@ class AIStatefulTask : public AIRefCount
       boost::signals2::connection connection;
       signal_type signal;
     };
-    callback_type* mCallback;           // Pointer to signal/connection, or nullptr when not connected.
+    // True when F can be called with a bool, except for a boost::signals2 slot (which has its own overload of run()).
+    template<typename F, typename = void>
+    struct is_completion_callback : std::false_type { };
+    template<typename F>
+    struct is_completion_callback<F, decltype(void(std::declval<typename std::decay<F>::type&>()(true)))> :
+        std::integral_constant<bool, !std::is_same<typename std::decay<F>::type, callback_type::signal_type::slot_type>::value> { };
+
+    // Fields that most tasks never use. These are only allocated upon first use (see rare()),
+    // so that a task that only ever calls wait(), yield() and finish() doesn't pay for them.
+    // Only accessed by the thread that owns the task.
+    struct rare_st {
+      AIWaitConditionPtr wait_condition;        // The condition passed to wait_until(), or nullptr.
+      void* wait_condition_context;             // The context passed to wait_until() (or &wait_condition_func).
+      AIWaitConditionFunc wait_condition_func;  // The std::function passed to wait_until(), if any.
+      condition_type wait_conditions;           // The conditions passed to wait_until().
+      clock_type::rep sleep;                    // Non-zero while the task is sleeping. Negative means frames, positive means clock periods.
+      AIEngine* target_engine;                  // Requested engine by a call to yield.
+      AICompletionCallback callback;            // The call back passed to run(), if any.
+      // Timeouts (see wait(conditions, timeout)). timeout_state is also accessed by the thread of AIWaitTimeouts.
+      std::atomic<uint32_t> timeout_state;      // timeout generation << 2 | timeout_fired | timeout_pending.
+      bool timed_out;                           // True when the current run is the result of a timeout.
+      bool defer_signals;                       // True when defer_signals() was called.
+      AIEngine* signal_engine;                  // The engine passed to defer_signals().
+      size_t timeout_index;                     // The index of the timeout of this task in the heap of AIWaitTimeouts, or no_timeout_index. Protected by the mutex of AIWaitTimeouts.
+      rare_st() : wait_condition(nullptr), wait_condition_context(nullptr), wait_conditions(0), sleep(0), target_engine(nullptr), timeout_state(0), timed_out(false),
+          defer_signals(false), signal_engine(nullptr), timeout_index(no_timeout_index) { }
+    };
+    static uint32_t const timeout_pending = 1;  // A timeout was registered with AIWaitTimeouts and the task didn't run since.
+    static uint32_t const timeout_fired = 2;    // The timeout expired before the task ran.
+    static int const timeout_generation_shift = 2;
+    static size_t const no_timeout_index = static_cast<size_t>(-1);
+    // The rarely used fields, or nullptr when none of them were used yet. Only changed by the thread that owns the task (see rare()),
+    // but also read by AIEngine::mainloop() (see sleep()), hence it is published with a release store.
+    std::atomic<rare_st*> mRare;
+
+    // A request for a notification passed to abort_async().
+    struct abort_notification_st {
+      abort_notification_st* next;
+      AICompletionCallback callback;
+      abort_notification_st(AICompletionCallback&& cb) : next(nullptr), callback(std::move(cb)) { }
+    };
+    // Pushed by any thread calling abort_async(); taken by the thread that owns the task when it calls the call back
+    // (at which point it is set to abort_notifications_closed() until the task is restarted).
+    std::atomic<abort_notification_st*> mAbortNotifications;
+    static abort_notification_st* abort_notifications_closed() { return reinterpret_cast<abort_notification_st*>(static_cast<uintptr_t>(1)); }
 
     // Engine stuff.
     AIEngine* mDefaultEngine;           // Default engine.
-    AIEngine* mTargetEngine;            // Requested engine by a call to yield.
+
+    // Only accessed by the thread that owns the task. The small fields are grouped here to avoid padding.
+    condition_type mParentCondition;    // The condition (bit) that the parent should be signalled with upon a successful finish.
+    on_abort_st mOnAbort;               // What to do with the parent (if any) when aborted.
     bool mYield;                        // True when any yield function was called, except for yield_if_not when the passed engine already matched.
+    std::atomic<priority_type> mPriority;       // The priority class of this task. May be changed by any thread.
+    uint8_t mAffinity;                  // 1 + the index of the auxiliary engine that this task was last added to (see AIAuxiliaryThread::affinity), or 0.
+
+    static unsigned int sMaxContinuationDepth;  // The maximum number of nested continuations per thread, or zero when disabled.
 
 #ifdef DEBUG
     // Debug stuff.
-    std::thread::id mThreadId;          // The thread currently running multiplex() (or std::thread::id() when none).
-    base_state_type mDebugLastState;    // The previous state that multiplex() had a normal run with.
     bool mDebugShouldRun;               // Set if we found evidence that we should indeed call multiplex_impl().
     bool mDebugAborted;                 // True when abort() was called.
     bool mDebugSignalPending;           // True while wait() was called but didn't get idle because of a pending call to signal() that wasn't handled yet.
     bool mDebugSetStatePending;         // True while set_state() was called by not handled yet.
     bool mDebugRefCalled;               // True when ref() is called (or will be called within the critial area of mMultiplexMutex).
+    base_state_type mDebugLastState;    // The previous state that multiplex() had a normal run with.
 #endif
 #ifdef CWDEBUG
   protected:
     bool mSMDebug;                      // Print debug output only when true.
 #endif
   private:
-    duration_type mDuration;            // Total time spent running in the main thread.
+    duration_type mDuration;            // Total time spent running in an engine.
+    std::atomic<uint64_t> mSignalTicks; // The time (see AITaskAccounting::now()) at which signal() made this task runnable, or zero.
 
   public:
-    AIStatefulTask(DEBUG_ONLY(bool debug)) : mCallback(nullptr), mDefaultEngine(nullptr), mTargetEngine(nullptr), mYield(false),
+    AIStatefulTask(DEBUG_ONLY(bool debug)) : mRunState(0), mControl(bs_reset), mBusy(0), mSkipWait(0), mCurrentEngine(nullptr),
+    mMultiplexThreadId(std::thread::id()), mRare(nullptr), mAbortNotifications(nullptr), mDefaultEngine(nullptr), mParentCondition(0), mOnAbort(do_nothing), mYield(false), mPriority(normal_priority), mAffinity(0),
 #ifdef DEBUG
-    mDebugLastState(bs_killed), mDebugShouldRun(false), mDebugAborted(false), mDebugSignalPending(false),
-    mDebugSetStatePending(false), mDebugRefCalled(false),
+    mDebugShouldRun(false), mDebugAborted(false), mDebugSignalPending(false),
+    mDebugSetStatePending(false), mDebugRefCalled(false), mDebugLastState(bs_killed),
 #endif
 #ifdef CWDEBUG
     mSMDebug(debug),
 #endif
-    mDuration(duration_type::zero()) { }
+    mDuration(duration_type::zero()), mSignalTicks(0) { }
 
   protected:
     // The user should call finish() (or abort(), or kill() from the call back when finish_impl() calls run()),
@@ -180,14 +263,25 @@ class AIStatefulTask : public AIRefCount
     virtual ~AIStatefulTask()
     {
 #ifdef DEBUG
-      base_state_type state = multiplex_state_type::rat(mState)->base_state;
+      base_state_type state = static_cast<base_state_type>(mControl.load(std::memory_order_acquire) & control_base_state_mask);
       ASSERT(state == bs_killed || state == bs_reset);
 #endif
+      rare_st* const rare_fields = rare_ptr();
+      // The reference count is already zero, so the thread of AIWaitTimeouts may not find this task in its heap anymore.
+      // A pending timeout is therefore cancelled before the last reference can be released (see cancel_timeout()).
+      ASSERT(!rare_fields || !(rare_fields->timeout_state.load(std::memory_order_relaxed) & timeout_pending));
+      delete rare_fields;
+      // Tasks that are destroyed without ever reaching the call back (for example, killed by AIEngine::flush()).
+      notify_abort(close_abort_notifications(), false);
     }
 
   public:
     // These functions may be called directly after creation, or from within finish_impl(), or from the call back function.
     void run(callback_type::signal_type::slot_type const& slot, AIEngine* default_engine = &gMainThreadEngine);
+    // Same, but for any callable with signature void(bool) (ie, a lambda). Small callables are stored inside the task,
+    // without any memory allocation; this is a lot cheaper than the boost::signals2 slot overload above.
+    template<typename F, typename = typename std::enable_if<is_completion_callback<F>::value>::type>
+    void run(F&& callback, AIEngine* default_engine = &gMainThreadEngine) { run_callback(AICompletionCallback(std::forward<F>(callback)), default_engine); }
     void run(AIStatefulTask* parent, condition_type condition, on_abort_st on_abort = abort_parent, AIEngine* default_engine = &gMainThreadEngine);
     void run(AIEngine* default_engine = nullptr) { run(nullptr, 0, do_nothing, default_engine); }
 
@@ -203,6 +297,16 @@ class AIStatefulTask : public AIRefCount
     void wait_until(AIWaitConditionFunc const& wait_condition, condition_type conditions);   // Block until the wait_condition returns true.
                                                 // Whenever something changed that might cause wait_condition to return true, signal(condition) must be called.
     void wait_until(AIWaitConditionFunc const& wait_condition, condition_type conditions, state_type new_state) { set_state(new_state); wait_until(wait_condition, conditions); }
+    void wait_until(AIWaitConditionPtr wait_condition, void* context, condition_type conditions); // Same, but calls wait_condition(context). This never allocates memory.
+    void wait_until(AIWaitConditionPtr wait_condition, void* context, condition_type conditions, state_type new_state) { set_state(new_state); wait_until(wait_condition, context, conditions); }
+    // The same as above, but if the task wasn't woken up within `timeout', then it runs anyway and timed_out() returns true
+    // during that run. In the case of wait_until, the wait condition is then forgotten. The timeouts of all tasks are handled
+    // by a single thread (see AIWaitTimeouts); no timer task is needed. That thread wakes up a timed out task with
+    // signal_deferred(), so the task resumes in its own engine, or in AIAuxiliaryThread::engine_for() when it has none.
+    void wait(condition_type conditions, std::chrono::steady_clock::duration timeout);
+    void wait_until(AIWaitConditionFunc const& wait_condition, condition_type conditions, std::chrono::steady_clock::duration timeout);
+    void wait_until(AIWaitConditionPtr wait_condition, void* context, condition_type conditions, std::chrono::steady_clock::duration timeout);
+    bool timed_out() const { return rare_ptr() && rare_ptr()->timed_out; }      // True when this run is the result of a timeout of the last wait.
     void finish();                              // Mark that the task finished and schedule the call back.
     void yield();                               // Yield to give CPU to other tasks, but do not block.
     void target(AIEngine* engine);              // Continue running from engine 'engine'. The task will keep running in this engine until target() is called again.
@@ -221,17 +325,41 @@ class AIStatefulTask : public AIRefCount
     // to access this task.
     void abort();                               // Abort the task (unsuccessful finish).
 
+    // The same as abort(), but never blocks: when the task is executing in another thread then abort() waits until
+    // that run finished, while abort_async() returns immediately and lets that thread handle the abort when it leaves
+    // multiplex_impl(). This is what a task running in an engine should use to abort a task that isn't its child,
+    // because otherwise it would stall the whole engine.
+    void abort_async();
+    // Same, but also request a notification for when the task handled the abort, that is, after abort_impl() and
+    // finish_impl() were called and the parent and call back were notified. The notification is also given when the
+    // task finished successfully before the abort could take effect (success is then true). If the task already
+    // finished, the notification is given immediately by the calling thread; otherwise by the thread that runs the task.
+    template<typename F, typename = typename std::enable_if<is_completion_callback<F>::value>::type>
+    void abort_async(F&& callback) { abort_async_notify(AICompletionCallback(std::forward<F>(callback))); }
+    // Same, but signal `waiter' with `condition' (regardless of success).
+    void abort_async(AIStatefulTask* waiter, condition_type condition);
+
     // This is the only function that can be called by any thread at any moment.
     // Those threads should use an boost::intrusive_ptr<AIStatefulTask> to access this task.
     bool signal(condition_type condition);      // Guarantee at least one full run of multiplex() iff this task is still blocked since
                                                 // the last call to wait(conditions) where (conditions & condition) != 0.
                                                 // Returns false if it already unblocked or is waiting on (a) different condition(s) now.
 
+    // The same as signal(), but never runs the task in the calling thread. If this makes a task without an engine of
+    // its own runnable, it is added to `engine' (or when that is nullptr, to AIAuxiliaryThread::engine_for(this))
+    // instead. Use this from threads that must stay responsive, like an I/O thread or a thread pool worker.
+    bool signal_deferred(condition_type condition, AIEngine* engine = nullptr);
+
+    // Let every signal() of this task behave like signal_deferred(condition, engine), or undo that.
+    // May only be called by the thread that runs the task (or before calling run()).
+    void defer_signals(AIEngine* engine = nullptr);
+    void inline_signals();                      // The default.
+
   public:
     // Accessors.
 
     // Return true if the derived class is running (also when we are blocked).
-    bool running() const { return multiplex_state_type::crat(mState)->base_state == bs_multiplex; }
+    bool running() const { return (mControl.load(std::memory_order_acquire) & control_base_state_mask) == bs_multiplex; }
 
     // Return true if the derived class is running and idle.
     bool waiting() const;
@@ -240,23 +368,28 @@ class AIStatefulTask : public AIRefCount
     bool waiting_or_aborting() const;
 
     // Return true if we are added to the current engine.
-    bool active(AIEngine const* engine) const { return multiplex_state_type::crat(mState)->current_engine == engine; }
+    bool active(AIEngine const* engine) const { return mCurrentEngine.load(std::memory_order_acquire) == engine; }
 
     // Return true if the task finished.
     // If this function returns false then the callback (or call to abort() on the parent) is guaranteed to still going to happen.
     // If this function returns true then the callback might have happened or might still going to happen.
     // Call aborted() to check if the task finished successfully if this function returns true (or just call that in the callback).
-    bool finished() const
-    {
-      sub_state_type::crat sub_state_r(mSubState);
-      return sub_state_r->finished ? &AIStatefulTask::mOnAbort : 0;
-    }
+    bool finished() const { return mControl.load(std::memory_order_acquire) & control_finished; }
 
     // Return true if this task was aborted. This value is guaranteed to be valid (only) after the task finished.
-    bool aborted() const { return sub_state_type::crat(mSubState)->aborted; }
+    bool aborted() const { return mControl.load(std::memory_order_acquire) & control_aborted; }
+
+    // Return the priority class of this task.
+    priority_type priority() const { return mPriority.load(std::memory_order_relaxed); }
+
+    // Set the priority class of this task. This may be called at any time, by any thread; for example right before
+    // calling run(). The new priority is used the next time that the task is added to an engine (it doesn't move
+    // the task when it is already in the queue of an engine) and by the next call to AIPackagedTask::dispatch().
+    // The priority is not reset by run(), so a restarted task keeps its priority.
+    void set_priority(priority_type priority) { mPriority.store(priority, std::memory_order_relaxed); }
 
     // Return true if this thread is executing this task right now (aka, we're inside multiplex() somewhere).
-    bool executing() const { return mMultiplexMutex.self_locked(); }
+    bool executing() const { return mMultiplexThreadId.load(std::memory_order_relaxed) == std::this_thread::get_id(); }
 
     // Return stringified state, for debugging purposes.
     static char const* state_str(base_state_type state);
@@ -267,6 +400,17 @@ class AIStatefulTask : public AIRefCount
     void add(duration_type delta) { mDuration += delta; }
     duration_type getDuration() const { return mDuration; }
 
+    // Write the size of AIStatefulTask and of each of its components to os.
+    static void print_sizeof_on(std::ostream& os);
+
+    // Let a parent task that is woken up by a child that successfully finishes continue running directly in
+    // the thread of that child, after the child released the task, instead of being added to an engine.
+    // This is only done when the parent can run in the engine that the child ran in (the target engine,
+    // or else the default engine, of the parent is that engine or nullptr), and only up to max_depth nested
+    // continuations per thread (a chain of tasks that finish one after another would otherwise grow the stack
+    // without bound). Passing zero (the default) disables continuations.
+    static void setMaxContinuationDepth(unsigned int max_depth) { sMaxContinuationDepth = max_depth; }
+
   protected:
     virtual char const* state_str_impl(state_type run_state) const = 0;
     virtual void initialize_impl();
@@ -277,21 +421,53 @@ class AIStatefulTask : public AIRefCount
 
   private:
     void reset();                               // Called from run() to (re)initialize a (re)start.
+    void run_callback(AICompletionCallback&& callback, AIEngine* default_engine);      // Called from run(F&&) and run(slot_type const&).
     void multiplex(event_type event, AIEngine* engine = nullptr); // Called to step through the states. If event == normal_run then engine is the engine this was called from.
-    state_type begin_loop();                    // Called from multiplex() at the start of a loop.
-    void callback();                            // Called when the task finished.
+    state_type begin_loop(ControlLock& control); // Called from multiplex() at the start of a loop.
+    bool start_run(ControlLock& control, base_state_type state); // Called from multiplex() after begin_loop(); returns true on a late abort.
+    uint64_t lock_control() const;              // Set control_locked and return the control word.
+    bool unblock(condition_type condition);     // Update busy and skip_wait for a call to signal(condition) and clear the idle mask if it has any bit of condition set; returns true if this thread did the latter.
+    void signal_continuation(condition_type condition, AIStatefulTask const* child, AIEngine* engine);   // Like signal(), but continue running after child's multiplex() if possible.
+    void callback(AIEngine* current_engine);    // Called when the task finished, from current_engine (or nullptr when not running in an engine).
+    void arm_timeout(clock_type::time_point deadline, condition_type conditions);   // Called from wait(conditions, timeout) and wait_until(..., timeout).
+    bool end_timeout();                         // Cancel the pending timeout, if any; returns true if it fired.
+    // Cancel a timeout that is still pending. Called from callback() and force_killed(), before the reference that the task holds on itself is released.
+    void cancel_timeout() { if (AI_UNLIKELY(rare_ptr()) && (rare_ptr()->timeout_state.load(std::memory_order_relaxed) & timeout_pending)) end_timeout(); }
+    bool timeout_expired(uint32_t generation, condition_type conditions);       // Called by AIWaitTimeouts. Returns false if the timeout was already cancelled.
+    void remove_timeout();                      // Remove the timeout of this task from AIWaitTimeouts, if it is still there.
+    void abort_async_notify(AICompletionCallback&& callback);   // Called from abort_async(F&&) and abort_async(waiter, condition).
+    abort_notification_st* close_abort_notifications();        // Take the notifications requested by abort_async() and refuse new ones.
+    static void notify_abort(abort_notification_st* list, bool success);  // Call and delete the list returned by close_abort_notifications().
+    // Allocate the rarely used fields upon first use.
+    rare_st& rare()
+    {
+      rare_st* rare_fields = mRare.load(std::memory_order_relaxed);
+      if (AI_UNLIKELY(!rare_fields))
+      {
+        rare_fields = new rare_st;
+        mRare.store(rare_fields, std::memory_order_release);
+      }
+      return *rare_fields;
+    }
+    // Return the rarely used fields, or nullptr when none of them were used yet. For the thread that owns the task.
+    rare_st* rare_ptr() const { return mRare.load(std::memory_order_relaxed); }
     bool sleep(clock_type::time_point current_time)   // Count frames if necessary and return true when the task is still sleeping.
     {
-      if (mSleep == 0)
+      // Called by AIEngine::mainloop() before it runs the task; pairs with the release store in rare().
+      rare_st* const rare_fields = mRare.load(std::memory_order_acquire);
+      if (AI_LIKELY(!rare_fields) || rare_fields->sleep == 0)
         return false;
-      else if (mSleep < 0)
-        ++mSleep;
-      else if (mSleep <= current_time.time_since_epoch().count())
-        mSleep = 0;
-      return mSleep != 0;
+      else if (rare_fields->sleep < 0)
+        ++rare_fields->sleep;
+      else if (rare_fields->sleep <= current_time.time_since_epoch().count())
+        rare_fields->sleep = 0;
+      return rare_fields->sleep != 0;
     }
 
     friend class AIEngine;                      // Calls multiplex() and force_killed().
+    friend class AITrace;                       // Uses base_state_type and state_str().
+    friend class AIWaitTimeouts;                // Calls timeout_expired() and accesses rare_st::timeout_index.
+    friend class AIAuxiliaryThread;             // Uses mAffinity.
 };
 
 #ifdef CWDEBUG
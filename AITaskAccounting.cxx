@@ -0,0 +1,275 @@
+/**
+ * @file
+ * @brief Implementation of AITaskAccounting.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+#include "sys.h"
+#include "AITaskAccounting.h"
+#include "utils/macros.h"
+#include "debug.h"
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <iostream>
+#include <iomanip>
+#include <cxxabi.h>
+#include <cstdlib>
+
+namespace {
+
+struct Counters {
+  // Only written by the thread that owns them; read by totals().
+  std::atomic<uint64_t> runs;
+  std::atomic<uint64_t> run_ticks;
+  std::atomic<uint64_t> pool_jobs;
+  std::atomic<uint64_t> pool_ticks;
+  Counters() : runs(0), run_ticks(0), pool_jobs(0), pool_ticks(0) { }
+};
+
+// Single writer increment; much cheaper than a fetch_add.
+inline void increment(std::atomic<uint64_t>& counter, uint64_t delta)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// The totals of a task class in ticks, as kept for threads that already exited.
+struct RetiredCounters {
+  uint64_t runs;
+  uint64_t run_ticks;
+  uint64_t pool_jobs;
+  uint64_t pool_ticks;
+  RetiredCounters() : runs(0), run_ticks(0), pool_jobs(0), pool_ticks(0) { }
+};
+
+struct ThreadCounters;
+
+// The counters per engine serial number, and per task class.
+template<typename T>
+using per_engine_type = std::unordered_map<uint32_t, std::unordered_map<std::type_index, T>>;
+
+// All ThreadCounters that currently exist, plus the totals of threads that already exited.
+struct Registry {
+  std::mutex mutex;
+  std::set<ThreadCounters*> threads;
+  per_engine_type<RetiredCounters> retired;
+};
+
+Registry& registry()
+{
+  // Constructed on first use and never destructed, so that threads that exit during static destruction can still use it.
+  static Registry* registry = new Registry;
+  return *registry;
+}
+
+struct ThreadCounters {
+  // The map is only changed by the owning thread, while holding mutex.
+  // The owning thread may read it without locking; other threads must lock mutex.
+  std::mutex mutex;
+  per_engine_type<Counters> map;
+  // Cache of the last lookup; tasks of the same class often run back to back. The elements of map never move.
+  std::type_info const* m_last_type;
+  uint32_t m_last_engine;
+  Counters* m_last_counters;
+
+  ThreadCounters() : m_last_type(nullptr), m_last_engine(AITaskAccounting::no_engine), m_last_counters(nullptr)
+  {
+    Registry& r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.threads.insert(this);
+  }
+
+  ~ThreadCounters()
+  {
+    Registry& r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (auto& engine_entry : map)
+      for (auto& entry : engine_entry.second)
+      {
+        RetiredCounters& retired(r.retired[engine_entry.first][entry.first]);
+        retired.runs += entry.second.runs;
+        retired.run_ticks += entry.second.run_ticks;
+        retired.pool_jobs += entry.second.pool_jobs;
+        retired.pool_ticks += entry.second.pool_ticks;
+      }
+    r.threads.erase(this);
+  }
+
+  Counters& get(std::type_info const& task_class, uint32_t engine_serial)
+  {
+    if (AI_LIKELY(m_last_type == &task_class && m_last_engine == engine_serial))
+      return *m_last_counters;
+    auto engine_iter = map.find(engine_serial);
+    if (AI_UNLIKELY(engine_iter == map.end()))
+    {
+      // First time this thread runs something for this engine.
+      std::lock_guard<std::mutex> lock(mutex);
+      engine_iter = map.emplace(std::piecewise_construct, std::forward_as_tuple(engine_serial), std::forward_as_tuple()).first;
+    }
+    auto& classes(engine_iter->second);
+    std::type_index key(task_class);
+    auto iter = classes.find(key);
+    if (AI_UNLIKELY(iter == classes.end()))
+    {
+      // First time this thread sees this task class (for this engine).
+      std::lock_guard<std::mutex> lock(mutex);
+      iter = classes.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first;
+    }
+    m_last_type = &task_class;
+    m_last_engine = engine_serial;
+    m_last_counters = &iter->second;
+    return iter->second;
+  }
+};
+
+thread_local ThreadCounters t_counters;
+
+// Used to convert ticks to nanoseconds.
+struct Calibration {
+  AITaskAccounting::tick_type const m_ticks;
+  std::chrono::steady_clock::time_point const m_time;
+  Calibration() : m_ticks(AITaskAccounting::now()), m_time(std::chrono::steady_clock::now()) { }
+
+  double nanoseconds_per_tick() const
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    AITaskAccounting::tick_type ticks = AITaskAccounting::now() - m_ticks;
+    double nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_time).count();
+    return ticks ? nanoseconds / ticks : 1.0;
+#else
+    return 1.0;
+#endif
+  }
+};
+
+Calibration const calibration;
+
+} // namespace
+
+//static
+double AITaskAccounting::nanoseconds_per_tick()
+{
+  return calibration.nanoseconds_per_tick();
+}
+
+//static
+void AITaskAccounting::add_run(std::type_info const& task_class, uint32_t engine_serial, tick_type ticks)
+{
+  Counters& counters(t_counters.get(task_class, engine_serial));
+  increment(counters.runs, 1);
+  increment(counters.run_ticks, ticks);
+}
+
+//static
+void AITaskAccounting::add_pool_job(std::type_info const& task_class, tick_type ticks)
+{
+  Counters& counters(t_counters.get(task_class, no_engine));
+  increment(counters.pool_jobs, 1);
+  increment(counters.pool_ticks, ticks);
+}
+
+namespace {
+
+// Sum the counters of all threads, of the engine with serial number *engine_serial, or of all engines if engine_serial is nullptr.
+AITaskAccounting::container_type sum_up(uint32_t const* engine_serial)
+{
+  std::unordered_map<std::type_index, RetiredCounters> sum;
+  {
+    Registry& r(registry());
+    std::lock_guard<std::mutex> registry_lock(r.mutex);
+    for (auto& engine_entry : r.retired)
+    {
+      if (engine_serial && engine_entry.first != *engine_serial)
+        continue;
+      for (auto& entry : engine_entry.second)
+      {
+        RetiredCounters& counters(sum[entry.first]);
+        counters.runs += entry.second.runs;
+        counters.run_ticks += entry.second.run_ticks;
+        counters.pool_jobs += entry.second.pool_jobs;
+        counters.pool_ticks += entry.second.pool_ticks;
+      }
+    }
+    for (ThreadCounters* thread_counters : r.threads)
+    {
+      std::lock_guard<std::mutex> lock(thread_counters->mutex);
+      for (auto& engine_entry : thread_counters->map)
+      {
+        if (engine_serial && engine_entry.first != *engine_serial)
+          continue;
+        for (auto& entry : engine_entry.second)
+        {
+          RetiredCounters& counters(sum[entry.first]);
+          counters.runs += entry.second.runs.load(std::memory_order_relaxed);
+          counters.run_ticks += entry.second.run_ticks.load(std::memory_order_relaxed);
+          counters.pool_jobs += entry.second.pool_jobs.load(std::memory_order_relaxed);
+          counters.pool_ticks += entry.second.pool_ticks.load(std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+  // Convert ticks to nanoseconds.
+  double const nanoseconds_per_tick = AITaskAccounting::nanoseconds_per_tick();
+  AITaskAccounting::container_type result;
+  for (auto& entry : sum)
+  {
+    AITaskAccounting::class_totals_st& totals(result[entry.first]);
+    totals.runs = entry.second.runs;
+    totals.run_nanoseconds = entry.second.run_ticks * nanoseconds_per_tick;
+    totals.pool_jobs = entry.second.pool_jobs;
+    totals.pool_nanoseconds = entry.second.pool_ticks * nanoseconds_per_tick;
+  }
+  return result;
+}
+
+} // namespace
+
+//static
+constexpr uint32_t AITaskAccounting::no_engine;
+
+//static
+AITaskAccounting::container_type AITaskAccounting::totals()
+{
+  return sum_up(nullptr);
+}
+
+//static
+AITaskAccounting::container_type AITaskAccounting::totals(uint32_t engine_serial)
+{
+  return sum_up(&engine_serial);
+}
+
+//static
+void AITaskAccounting::print_on(std::ostream& os)
+{
+  for (auto& entry : totals())
+  {
+    int status;
+    char* demangled = abi::__cxa_demangle(entry.first.name(), nullptr, nullptr, &status);
+    os << std::setw(40) << std::left << (status == 0 ? demangled : entry.first.name()) << std::right <<
+        " runs: " << std::setw(10) << entry.second.runs << " (" << std::setw(12) << entry.second.run_nanoseconds << " ns)"
+        "; pool jobs: " << std::setw(10) << entry.second.pool_jobs << " (" << std::setw(12) << entry.second.pool_nanoseconds << " ns)\n";
+    std::free(demangled);
+  }
+}
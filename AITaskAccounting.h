@@ -0,0 +1,101 @@
+/**
+ * @file
+ * @brief Always-on per task class accounting of the time spent running stateful tasks.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+#pragma once
+
+#include <map>
+#include <chrono>
+#include <iosfwd>
+#include <typeinfo>
+#include <typeindex>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Accounting of the time that every task class spends executing code.
+//
+// AIStatefulTask::multiplex() measures every call to one of the *_impl() functions
+// (and the call back), irrespective of whether that happens from an engine or
+// inline from a call to signal(). AIPackagedTask measures the jobs that it runs
+// in the thread pool and attributes those to the class of the task that dispatched them.
+//
+// Runs are also split up by the engine whose thread ran them (see AIEngine::serial()),
+// so that totals(engine_serial) tells what a single engine spends its time on; runs
+// that happen inline from a call to signal() are accounted to no_engine, as are pool jobs.
+//
+// The counters are kept per thread, so updating them never contends with
+// other threads; totals() sums everything up and may be called at any time.
+//
+// Usage:
+//
+// AITaskAccounting::print_on(std::cout);      // Print a table with the totals per task class.
+// gMainThreadEngine.task_class_statistics();   // The same, but only the runs done by gMainThreadEngine.
+//
+class AITaskAccounting
+{
+  public:
+    using tick_type = uint64_t;         // The type returned by now(): TSC cycles where available, otherwise nanoseconds.
+
+    struct class_totals_st {
+      uint64_t runs;                    // Number of calls to *_impl() (and the call back).
+      uint64_t run_nanoseconds;         // The total time spent in those calls.
+      uint64_t pool_jobs;               // Number of thread pool jobs dispatched by tasks of this class.
+      uint64_t pool_nanoseconds;        // The total time spent executing those jobs.
+      class_totals_st() : runs(0), run_nanoseconds(0), pool_jobs(0), pool_nanoseconds(0) { }
+    };
+    using container_type = std::map<std::type_index, class_totals_st>;
+
+    static constexpr uint32_t no_engine = 0;   // The engine serial of runs that weren't done by an engine, and of pool jobs.
+
+    // Return the current time in ticks. This is meant to be as cheap as possible.
+    static tick_type now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // Return the number of nanoseconds per tick, as measured since the start of the program.
+    static double nanoseconds_per_tick();
+
+    // Account `ticks' to a run of task class `task_class' by the engine with serial number `engine_serial' (or no_engine).
+    static void add_run(std::type_info const& task_class, uint32_t engine_serial, tick_type ticks);
+
+    // Account `ticks' to a thread pool job that was dispatched by a task of class `task_class'.
+    static void add_pool_job(std::type_info const& task_class, tick_type ticks);
+
+    // Return the totals per task class, summed over all threads (including threads that already exited).
+    static container_type totals();
+
+    // The same, but only the runs done by the engine with serial number `engine_serial'.
+    static container_type totals(uint32_t engine_serial);
+
+    // Write totals() in human readable form to os.
+    static void print_on(std::ostream& os);
+};
@@ -0,0 +1,75 @@
+/**
+ * @file
+ * @brief Run any number of child tasks and wait for all of them at once. Implementation of class AITaskGroup.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#include "sys.h"
+#include "AITaskGroup.h"
+#include "debug.h"
+
+AITaskGroup::~AITaskGroup()
+{
+  // It should be impossible to destruct a group while it still has running children,
+  // because every child keeps a reference to the parent task of which we are a member.
+  ASSERT(m_count.load(std::memory_order_relaxed) <= 1);
+}
+
+void AITaskGroup::run(AIStatefulTask* child, AIEngine* default_engine)
+{
+  if (m_joined)
+  {
+    // The first child after a join: start a new group. The parent takes its extra reference again.
+    m_joined = false;
+    m_aborted.store(0, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  child->run(on_child_finished{this, m_parent_task}, default_engine);
+}
+
+bool AITaskGroup::join()
+{
+  if (!m_joined)
+  {
+    m_joined = true;
+    // Release the reference of the parent; if that was the last one then all children already finished.
+    if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      return true;
+  }
+  else if (m_count.load(std::memory_order_acquire) == 0)
+    return true;
+  // If the last child finishes before we get idle, then its call to signal() causes wait() to not go idle.
+  wait(m_condition);
+  return false;
+}
+
+void AITaskGroup::child_finished(bool success)
+{
+  if (!success)
+    m_aborted.fetch_add(1, std::memory_order_relaxed);
+  // Only the last child wakes up the parent.
+  if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    m_parent_task->signal(m_condition);
+}
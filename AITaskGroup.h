@@ -0,0 +1,131 @@
+/**
+ * @file
+ * @brief Run any number of child tasks and wait for all of them at once. Declaration of class AITaskGroup.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#pragma once
+
+#include "AIFriendOfStatefulTask.h"
+#include "AIEngine.h"
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <cstdint>
+
+#ifdef EXAMPLE_CODE     // undefined
+
+class Task : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;            // The base class of this task.
+    ~Task() override { }                                // The destructor must be protected.
+
+    // The different states of the task.
+    enum task_state_type {
+      Task_start = direct_base_type::max_state,
+      Task_join,
+    };
+
+    // Override virtual functions.
+    char const* state_str_impl(state_type run_state) const override;
+    void multiplex_impl(state_type run_state) override;
+
+  public:
+    static state_type const max_state = Task_join + 1;  // One beyond the largest state.
+    Task() : AIStatefulTask(DEBUG_ONLY(true)), m_children(this, 1) { }
+
+  private:
+    AITaskGroup m_children;
+};
+
+void Task::multiplex_impl(state_type run_state)
+{
+  switch(run_state)
+  {
+    case Task_start:
+      for (int i = 0; i < 1000; ++i)
+        m_children.run(new Child(i));                   // Run a thousand children.
+      set_state(Task_join);
+      // Fall through.
+    case Task_join:
+      if (!m_children.join())                           // Wait until all of them finished (this calls wait(1)).
+        break;
+      if (m_children.aborted() > 0)                     // Did any of them abort?
+        abort();
+      else
+        finish();
+      break;
+  }
+}
+#endif // EXAMPLE_CODE
+
+// A group of child tasks that a parent task can wait for at once.
+//
+// Every child is run with a call back that decrements a counter; only the
+// child that brings the counter to zero signals the parent (with the condition
+// passed to the constructor), so the parent is woken up once per join() instead
+// of once per child, and the number of children isn't limited by the number of
+// bits in condition_type.
+//
+// The counter includes one extra reference that is held by the parent until it
+// calls join(), so that the group doesn't become empty while children are still
+// being added. After join() returned true, the next call to run() starts a new
+// group (and resets aborted()).
+//
+// Every running child keeps a reference to the parent task, so the parent (and
+// therefore this object) isn't destructed before all children have finished.
+//
+class AITaskGroup : AIFriendOfStatefulTask
+{
+  private:
+    condition_type const m_condition;   // The condition that the parent is signalled with.
+    std::atomic<uint64_t> m_count;      // The number of running children, plus one until join() was called.
+    std::atomic<uint32_t> m_aborted;    // The number of children that were aborted.
+    bool m_joined;                      // Set by join(); only accessed by the parent task.
+
+    struct on_child_finished {
+      AITaskGroup* m_group;
+      boost::intrusive_ptr<AIStatefulTask> m_parent;    // Keep the parent alive until the last child signalled it.
+      void operator()(bool success) const { m_group->child_finished(success); }
+    };
+
+    void child_finished(bool success);
+
+  public:
+    AITaskGroup(AIStatefulTask* parent_task, condition_type condition) :
+        AIFriendOfStatefulTask(parent_task), m_condition(condition), m_count(1), m_aborted(0), m_joined(false) { }
+
+    ~AITaskGroup();
+
+    // Run `child' as part of this group. Must be called by the parent task (from multiplex_impl()).
+    void run(AIStatefulTask* child, AIEngine* default_engine = &gMainThreadEngine);
+
+    // Return true when all children that were added since the previous join have finished.
+    // Otherwise call wait() with the condition passed to the constructor and return false;
+    // in that case call join() again when the parent task runs again.
+    bool join();
+
+    // The number of children of the current group that were aborted.
+    // Only complete after join() returned true.
+    uint32_t aborted() const { return m_aborted.load(std::memory_order_acquire); }
+};
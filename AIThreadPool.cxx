@@ -1,6 +1,7 @@
 #include "sys.h"
 #include "debug.h"
 #include "AIThreadPool.h"
+#include <algorithm>
 
 //static
 std::atomic<AIThreadPool*> AIThreadPool::s_instance;
@@ -18,17 +19,35 @@ void AIThreadPool::Worker::main(int const self)
     continue;
   }
 
+  unsigned int jobs = 0;
   while(workers_t::rat(AIThreadPool::instance().m_workers)->at(self).running())
   {
     std::function<void()> f;
-    { // Lock the queue for other consumer threads.
+    {
       auto queues_r = AIThreadPool::instance().queues_read_access();
-      queues_container_t::value_type& queue = queues_r->at(0);
-      auto access = queue.consumer_access();
-      int length = access.length();
-      if (length == 0) { std::this_thread::sleep_for(std::chrono::microseconds(10)); continue; }
-      f = access.move_out();
-    } // Unlock the queue.
+      // Look for a job in the order of priority class first, and the priority of the queue second.
+      int const number_of_queues = queues_r->size();
+      int const number_of_rings = PriorityQueue::number_of_classes * number_of_queues;
+      // Only jobs that were taken are counted (see below), so a thread that finds nothing keeps searching in the same order.
+      bool const lowest_first = jobs % lowest_first_period == lowest_first_period - 1;
+      for (int i = 0; i < number_of_rings; ++i)
+      {
+        int const r = lowest_first ? number_of_rings - 1 - i : i;
+        PriorityQueue::ring_type& ring = queues_r->by_priority(r % number_of_queues).for_class(r / number_of_queues);
+        // Most rings are empty most of the time; don't lock those.
+        if (ring.empty())
+          continue;
+        // Lock the queue for other consumer threads.
+        auto access = ring.consumer_access();
+        if (access.length() > 0)
+        {
+          f = access.move_out();
+          ++jobs;
+          break;
+        }
+      } // Unlock the queue.
+    }
+    if (!f) { std::this_thread::sleep_for(std::chrono::microseconds(10)); continue; }
     f(); // Invoke the functor.
   }
 
@@ -147,13 +166,32 @@ void AIThreadPool::change_number_of_threads_to(int requested_number_of_threads)
   }
 }
 
+int AIThreadPool::queues_container_t::add(int const (&capacities)[PriorityQueue::number_of_classes], int priority)
+{
+  int const index = m_queues.size();
+  m_queues.emplace_back(capacities, priority);
+  // Keep m_order sorted by decreasing priority.
+  auto pos = m_order.begin();
+  while (pos != m_order.end() && m_queues[*pos].priority() >= priority)
+    ++pos;
+  m_order.insert(pos, index);
+  return index;
+}
+
 int AIThreadPool::new_queue(int capacity, int priority)
 {
-  DoutEntering(dc::threadpool, "AIThreadPool::new_queue(" << capacity << ", " << priority << ")");
+  int const other_capacity = std::max(1, capacity / 4);
+  static_assert(PriorityQueue::number_of_classes == 3, "Update the capacities below.");
+  int const capacities[PriorityQueue::number_of_classes] = { other_capacity, capacity, other_capacity };
+  return new_queue(capacities, priority);
+}
+
+int AIThreadPool::new_queue(int const (&capacities)[PriorityQueue::number_of_classes], int priority)
+{
+  DoutEntering(dc::threadpool, "AIThreadPool::new_queue({" << capacities[0] << ", " << capacities[1] << ", " << capacities[2] << "}, " << priority << ")");
   queues_t::wat queues_w(m_queues);
-  size_t index = queues_w->size();
-  queues_w->emplace_back(std::move(queues_container_t::value_type(capacity)));
-  Dout(dc::threadpool, "Returning index " << index << "; size is now " << queues_w->size() << " for std::vector<> at " << (void*)&*queues_w);
+  int const index = queues_w->add(capacities, priority);
+  Dout(dc::threadpool, "Returning index " << index << "; size is now " << queues_w->size() << " for queues_container_t at " << (void*)&*queues_w);
   return index;
 }
 
@@ -150,9 +150,59 @@ class AIThreadPool {
     // Remove threads from the already read locked m_workers container.
     static void remove_threads(workers_t::rat& workers_r, int n);
 
-    using queues_container_t = std::vector<AIObjectQueue<std::function<void()>>>;
+  public:
+    // A queue of jobs, created with new_queue(). It has one ring buffer per priority class of the task
+    // that puts a job in it (see AIStatefulTask::priority_type), so that the jobs of a task of a higher
+    // class are executed before those of lower classes that were queued earlier. Each ring has its own
+    // capacity, so that the rings for the classes that are rarely used don't cost as much memory.
+    class PriorityQueue {
+      public:
+        using ring_type = AIObjectQueue<std::function<void()>>;
+        static int const number_of_classes = 3;        // If you change this, then also change the move constructor.
+
+      private:
+        ring_type m_rings[number_of_classes];
+        int m_priority;
+
+      public:
+        PriorityQueue(int const (&capacities)[number_of_classes], int priority) : m_priority(priority)
+          { for (int priority_class = 0; priority_class < number_of_classes; ++priority_class) m_rings[priority_class].reallocate(capacities[priority_class]); }
+        PriorityQueue(PriorityQueue&& rvalue) :
+            m_rings{std::move(rvalue.m_rings[0]), std::move(rvalue.m_rings[1]), std::move(rvalue.m_rings[2])}, m_priority(rvalue.m_priority) { }
+
+        // The ring buffer for jobs of tasks of priority class priority_class (0 is the highest class).
+        ring_type& for_class(int priority_class) { return m_rings[priority_class]; }
+        ring_type const& for_class(int priority_class) const { return m_rings[priority_class]; }
+
+        int capacity(int priority_class) const { return m_rings[priority_class].capacity(); }
+        int priority() const { return m_priority; }
+    };
+
+  private:
+    // All queues, indexed by queue handle.
+    class queues_container_t {
+      private:
+        std::vector<PriorityQueue> m_queues;
+        std::vector<int> m_order;       // Queue handles in order of decreasing priority (in the order of creation for equal priorities).
+
+      public:
+        // Add a new queue and return its handle.
+        int add(int const (&capacities)[PriorityQueue::number_of_classes], int priority);
+
+        int size() const { return m_queues.size(); }
+        PriorityQueue& at(int queue_handle) { return m_queues.at(queue_handle); }
+        PriorityQueue const& at(int queue_handle) const { return m_queues.at(queue_handle); }
+        // The n-th queue in order of decreasing priority.
+        PriorityQueue& by_priority(int n) { return m_queues[m_order[n]]; }
+    };
     using queues_t = aithreadsafe::Wrapper<queues_container_t, aithreadsafe::policy::Primitive<std::mutex>>;
 
+    // Every lowest_first_period-th job that a worker thread takes, it looks for that job starting at the lowest priority,
+    // so that jobs of a lower priority are still executed while the higher priorities keep all threads busy.
+    // That search is the normal order reversed: the lowest class first and, within a class, the queue with the
+    // lowest priority first. So it also keeps jobs in low priority queues from starving behind high priority queues.
+    static unsigned int const lowest_first_period = 8;
+
   private:
     static std::atomic<AIThreadPool*> s_instance;               // The only instance of AIThreadPool that should exist at a time.
     queues_t m_queues;                                          // List of queues. 
@@ -194,17 +244,22 @@ class AIThreadPool {
     // Lock m_queues and get access (return value is to be passed to get_queue).
     AIThreadPool::queues_t::rat queues_read_access() { return m_queues; }
 
-    // Create a new queue with capacity `capacity' and return a handle for it.
+    // Create a new queue and return a handle for it. Worker threads take jobs from the queue with the highest priority
+    // first; but the priority class of the task that dispatched a job goes before the priority of the queue.
+    //
+    // The first version has room for `capacity' jobs of tasks of normal priority, and for a quarter of that
+    // (but at least one) for each of the other priority classes; the second version sets the capacity per class.
     int new_queue(int capacity, int priority = 256);
+    int new_queue(int const (&capacities)[PriorityQueue::number_of_classes], int priority = 256);
 
     // Return a reference to the queue that belongs to queue_handle.
     // The returned pointer is only valid until a new queue is requested, which
     // is blocked for as long as queues_r isn't destructed: keep the read-access
     // object around until the returned reference is no longer used.
-    queues_container_t::value_type& get_queue(queues_t::rat& queues_r, int queue_handle) { return queues_r->at(queue_handle); }
+    PriorityQueue& get_queue(queues_t::rat& queues_r, int queue_handle) { return queues_r->at(queue_handle); }
 
     // Same for a const AIThreadPool (is that ever used?)
-    queues_container_t::value_type const& get_queue(queues_t::crat& queues_cr, int queue_handle) const { return queues_cr->at(queue_handle); }
+    PriorityQueue const& get_queue(queues_t::crat& queues_cr, int queue_handle) const { return queues_cr->at(queue_handle); }
 
     //------------------------------------------------------------------------
 
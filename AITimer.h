@@ -35,6 +35,7 @@
 
 #include "AIStatefulTask.h"
 #include "AIFrameTimer.h"
+#include "AISlabAllocator.h"
 
 // A timer task.
 //
@@ -60,7 +61,10 @@
 // You can call run(...) with parameters too, but using run() without parameters will
 // just reuse the old ones (call the same callback).
 //
-class AITimer : public AIStatefulTask {
+// Timers are typically short lived and created and destroyed by different threads,
+// therefore they are allocated with a slab allocator (see AISlabAllocated).
+//
+class AITimer : public AIStatefulTask, public AISlabAllocated<AITimer> {
   protected:
     // The base class of this task.
     using direct_base_type = AIStatefulTask;
@@ -0,0 +1,270 @@
+/**
+ * @file
+ * @brief Timeline tracing of tasks with Chrome trace export. Implementation of class AITrace.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#include "sys.h"
+#include "AITrace.h"
+#include "AIStatefulTask.h"
+#include "debug.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <cxxabi.h>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// An event is stored as words that are each written and read atomically, because write_chrome_trace()
+// copies events while their thread might be overwriting them. A torn copy is detected afterwards from head.
+static_assert(sizeof(AITrace::event_st) % sizeof(uint64_t) == 0, "AITrace::event_st must be a whole number of words.");
+size_t constexpr words_per_event = sizeof(AITrace::event_st) / sizeof(uint64_t);
+
+struct Slot {
+  std::atomic<uint64_t> words[words_per_event];
+};
+
+struct ThreadBuffer {
+  std::unique_ptr<Slot[]> slots;                // The ring buffer.
+  size_t size;                                  // The number of slots; a power of two. Only changed by the owning thread, while holding the registry mutex.
+  std::atomic<uint64_t> head;                   // The number of events written so far; only written by the owning thread.
+  unsigned int const thread_number;             // Used as tid in the output.
+  std::atomic<bool> exited;                     // Set when the owning thread exited.
+  ThreadBuffer(unsigned int number, size_t events) : slots(new Slot[events]), size(events), head(0), thread_number(number), exited(false) { }
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<ThreadBuffer*> buffers;
+  unsigned int next_thread_number;
+  // Used to convert ticks to microseconds.
+  AITrace::tick_type const start_ticks;
+  std::chrono::steady_clock::time_point const start_time;
+  Registry() : next_thread_number(1), start_ticks(AITaskAccounting::now()), start_time(std::chrono::steady_clock::now()) { }
+};
+
+Registry& registry()
+{
+  // Constructed on first use and never destructed, so that threads that exit during static destruction can still use it.
+  static Registry* registry = new Registry;
+  return *registry;
+}
+
+// The buffer of a thread is kept after the thread exits, so that its events can still be written out.
+struct ThreadBufferHandle {
+  ThreadBuffer* buffer;
+  ThreadBufferHandle() : buffer(nullptr) { }
+  ~ThreadBufferHandle() { if (buffer) buffer->exited.store(true, std::memory_order_release); }
+
+  ThreadBuffer& get(size_t events)
+  {
+    if (AI_UNLIKELY(!buffer || buffer->size != events))
+    {
+      Registry& r(registry());
+      std::lock_guard<std::mutex> lock(r.mutex);
+      if (!buffer)
+      {
+        buffer = new ThreadBuffer(r.next_thread_number++, events);
+        r.buffers.push_back(buffer);
+      }
+      else
+      {
+        // start() was called with another size.
+        buffer->slots.reset(new Slot[events]);
+        buffer->size = events;
+        buffer->head.store(0, std::memory_order_relaxed);
+      }
+    }
+    return *buffer;
+  }
+};
+
+thread_local ThreadBufferHandle t_buffer;
+
+std::string class_name(std::type_info const* type, std::map<std::type_info const*, std::string>& cache)
+{
+  auto iter = cache.find(type);
+  if (iter != cache.end())
+    return iter->second;
+  int status;
+  char* demangled = abi::__cxa_demangle(type->name(), nullptr, nullptr, &status);
+  std::string name(status == 0 ? demangled : type->name());
+  std::free(demangled);
+  cache.emplace(type, name);
+  return name;
+}
+
+} // namespace
+
+//static
+std::atomic<unsigned int> AITrace::s_sample_rate(0);
+
+//static
+std::atomic<size_t> AITrace::s_events_per_thread(AITrace::default_events_per_thread);
+
+//static
+thread_local unsigned int AITrace::s_countdown = 1;
+
+//static
+constexpr size_t AITrace::default_events_per_thread;
+
+//static
+void AITrace::start(unsigned int sample_rate, size_t events_per_thread)
+{
+  ASSERT(sample_rate > 0 && events_per_thread > 0);
+  size_t size = 1;
+  while (size < events_per_thread)
+    size <<= 1;
+  registry();                                   // Calibrate before the first event.
+  s_events_per_thread.store(size, std::memory_order_relaxed);
+  s_sample_rate.store(sample_rate, std::memory_order_relaxed);
+}
+
+//static
+void AITrace::record(event_st const& event)
+{
+  ThreadBuffer& buffer(t_buffer.get(s_events_per_thread.load(std::memory_order_relaxed)));
+  uint64_t const head = buffer.head.load(std::memory_order_relaxed);
+  Slot& slot(buffer.slots[head & (buffer.size - 1)]);
+  // A reader that sees any of the stores below, also sees the previous store to head (see write_chrome_trace).
+  std::atomic_thread_fence(std::memory_order_release);
+  uint64_t words[words_per_event];
+  std::memcpy(words, &event, sizeof(event_st));
+  for (size_t i = 0; i < words_per_event; ++i)
+    slot.words[i].store(words[i], std::memory_order_relaxed);
+  buffer.head.store(head + 1, std::memory_order_release);
+}
+
+//static
+void AITrace::clear()
+{
+  ASSERT(!enabled());
+  Registry& r(registry());
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (auto iter = r.buffers.begin(); iter != r.buffers.end();)
+  {
+    if ((*iter)->exited.load(std::memory_order_acquire))
+    {
+      delete *iter;
+      iter = r.buffers.erase(iter);
+    }
+    else
+    {
+      (*iter)->head.store(0, std::memory_order_relaxed);
+      ++iter;
+    }
+  }
+}
+
+//static
+void AITrace::write_chrome_trace(std::ostream& os)
+{
+  Registry& r(registry());
+  double microseconds_per_tick = 0.001;
+#if defined(__x86_64__) || defined(__i386__)
+  {
+    tick_type const ticks = AITaskAccounting::now() - r.start_ticks;
+    double const nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - r.start_time).count();
+    if (ticks)
+      microseconds_per_tick = nanoseconds / ticks / 1000.0;
+  }
+#endif
+  std::map<std::type_info const*, std::string> names;
+  std::vector<event_st> events;
+  std::ios_base::fmtflags const flags = os.flags();
+  std::streamsize const precision = os.precision();
+  os << std::fixed << std::setprecision(3);
+  os << "{\"traceEvents\":[\n";
+  char const* separator = "";
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (ThreadBuffer* buffer : r.buffers)
+  {
+    // Copy the events that weren't overwritten before we finished copying them.
+    size_t const size = buffer->size;
+    uint64_t const head = buffer->head.load(std::memory_order_acquire);
+    uint64_t begin = head > size ? head - size : 0;
+    events.resize(head - begin);
+    for (uint64_t i = begin; i < head; ++i)
+    {
+      Slot const& slot(buffer->slots[i & (size - 1)]);
+      uint64_t words[words_per_event];
+      for (size_t w = 0; w < words_per_event; ++w)
+        words[w] = slot.words[w].load(std::memory_order_relaxed);
+      std::memcpy(&events[i - begin], words, sizeof(event_st));
+    }
+    // If we copied (part of) an event that was being written then we see its head here, or a later one.
+    // Event new_head might still be being written, so every event before new_head + 1 - size can be torn.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t const new_head = buffer->head.load(std::memory_order_relaxed);
+    if (new_head + 1 > begin + size)
+      events.erase(events.begin(), events.begin() + std::min<uint64_t>(new_head + 1 - size - begin, events.size()));
+
+    unsigned int const tid = buffer->thread_number;
+    os << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":\"thread " << tid << "\"}}";
+    separator = ",\n";
+    for (event_st const& event : events)
+    {
+      os << separator << "{\"pid\":1,\"tid\":" << tid << ",\"ts\":" << (event.time - r.start_ticks) * microseconds_per_tick;
+      switch (event.kind)
+      {
+        case task_run:
+          os << ",\"ph\":\"X\",\"cat\":\"run\",\"dur\":" << event.duration * microseconds_per_tick <<
+              ",\"name\":\"" << class_name(event.type, names) << "\",\"args\":{\"task\":\"" << event.task <<
+              "\",\"base_state\":\"" << AIStatefulTask::state_str(static_cast<AIStatefulTask::base_state_type>(event.base_state)) << "\"";
+          if (event.base_state == AIStatefulTask::bs_multiplex)
+            os << ",\"run_state\":" << event.value;
+          os << "}}";
+          break;
+        case task_set_state:
+          os << ",\"ph\":\"i\",\"s\":\"t\",\"cat\":\"task\",\"name\":\"set_state\",\"args\":{\"task\":\"" << event.task << "\",\"run_state\":" << event.value << "}}";
+          break;
+        case task_wait:
+          os << ",\"ph\":\"i\",\"s\":\"t\",\"cat\":\"task\",\"name\":\"wait\",\"args\":{\"task\":\"" << event.task << "\",\"conditions\":" << event.value << "}}";
+          break;
+        case task_signal:
+          os << ",\"ph\":\"i\",\"s\":\"t\",\"cat\":\"task\",\"name\":\"signal\",\"args\":{\"task\":\"" << event.task << "\",\"condition\":" << event.value << "}}";
+          break;
+        case engine_add:
+          os << ",\"ph\":\"i\",\"s\":\"t\",\"cat\":\"engine\",\"name\":\"add to " << event.name << "\",\"args\":{\"task\":\"" << event.task << "\"}}";
+          break;
+        case engine_remove:
+          os << ",\"ph\":\"i\",\"s\":\"t\",\"cat\":\"engine\",\"name\":\"remove from " << event.name << "\",\"args\":{\"task\":\"" << event.task << "\"}}";
+          break;
+        case pool_job:
+          os << ",\"ph\":\"X\",\"cat\":\"pool\",\"dur\":" << event.duration * microseconds_per_tick <<
+              ",\"name\":\"" << class_name(event.type, names) << " job\",\"args\":{\"task\":\"" << event.task << "\"}}";
+          break;
+      }
+    }
+  }
+  os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  os.flags(flags);
+  os.precision(precision);
+}
@@ -0,0 +1,191 @@
+/**
+ * @file
+ * @brief Timeline tracing of tasks with Chrome trace export. Declaration of class AITrace.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#pragma once
+
+#include "AITaskAccounting.h"
+#include "utils/macros.h"
+#include <atomic>
+#include <iosfwd>
+#include <typeinfo>
+#include <cstdint>
+
+// A timeline tracer that is meant to be used in release builds.
+//
+// While started, events are recorded into a ring buffer per thread: only the
+// thread that owns the buffer writes to it, so recording an event doesn't need
+// a lock or an atomic read-modify-write. When a buffer is full the oldest events
+// are overwritten. When stopped, each hook costs a single relaxed atomic load.
+// The buffer of a thread is allocated when that thread records its first event,
+// and its size is set by start(). The buffers of threads that exited are freed
+// by clear().
+//
+// Recorded are:
+//   - every run of a task (one call to one of the *_impl() functions from multiplex()), with its duration,
+//   - set_state(), wait() and signal(),
+//   - tasks being added to and removed from an engine,
+//   - AIPackagedTask jobs executed by the thread pool, with their duration.
+//
+// To keep the overhead low, only one in `sample_rate' events of each thread is recorded.
+//
+// Usage:
+//
+// AITrace::start(10);                                  // Record one in ten events.
+// ...
+// AITrace::stop();
+// std::ofstream file("trace.json");
+// AITrace::write_chrome_trace(file);                   // Open in chrome://tracing or https://ui.perfetto.dev.
+//
+class AITrace
+{
+  public:
+    using tick_type = AITaskAccounting::tick_type;
+
+    enum event_type : uint8_t {
+      task_run,                         // A run of a task; `value' is the run state, `base_state' the base state.
+      task_set_state,                   // set_state(value).
+      task_wait,                        // wait(value).
+      task_signal,                      // signal(value).
+      engine_add,                       // The task was added to engine `name'.
+      engine_remove,                    // The task was removed from engine `name'.
+      pool_job                          // A job, dispatched by the task, was executed by the thread pool.
+    };
+
+    struct event_st {
+      tick_type time;                   // When the event happened, or when it started.
+      tick_type duration;               // The duration of task_run and pool_job events; otherwise zero.
+      void const* task;                 // The task that the event is about.
+      union {
+        std::type_info const* type;     // The class of the task (task_run and pool_job).
+        char const* name;               // The name of the engine (engine_add and engine_remove).
+      };
+      uint32_t value;
+      event_type kind;
+      uint8_t base_state;
+    };
+
+    static constexpr size_t default_events_per_thread = 16384;  // The default size of each ring buffer (640 kB).
+
+  private:
+    static std::atomic<unsigned int> s_sample_rate;     // Zero when stopped.
+    static std::atomic<size_t> s_events_per_thread;     // The size of new ring buffers; a power of two.
+    static thread_local unsigned int s_countdown;       // The number of events that this thread still skips before recording one.
+
+    // Return true if the next event should be recorded.
+    static bool sample()
+    {
+      unsigned int const sample_rate = s_sample_rate.load(std::memory_order_relaxed);
+      if (AI_LIKELY(sample_rate == 0) || --s_countdown != 0)
+        return false;
+      s_countdown = sample_rate;
+      return true;
+    }
+
+    static void record(event_st const& event);
+
+  public:
+    // Start recording one in sample_rate events (per thread), into ring buffers of events_per_thread events
+    // (rounded up to a power of two). Events that were recorded before are kept, unless events_per_thread
+    // differs from the size of the buffer of a thread; that buffer is then replaced by an empty one of
+    // the new size when the thread records its next event.
+    static void start(unsigned int sample_rate = 1, size_t events_per_thread = default_events_per_thread);
+    // Stop recording.
+    static void stop() { s_sample_rate.store(0, std::memory_order_relaxed); }
+    // Return true while started.
+    static bool enabled() { return AI_UNLIKELY(s_sample_rate.load(std::memory_order_relaxed) != 0); }
+    // Discard all recorded events and free the buffers of threads that exited. Only call this while stopped.
+    static void clear();
+
+    // Write everything that was recorded in the Chrome trace event format (which is also read by Perfetto).
+    // The output is only complete when stopped; events that are overwritten while copying them are left out.
+    static void write_chrome_trace(std::ostream& os);
+
+    // Hooks; these do nothing unless enabled, and only record one in sample_rate events.
+    static void run(void const* task, std::type_info const& type, uint8_t base_state, uint32_t run_state, tick_type start, tick_type end)
+    {
+      if (sample())
+      {
+        event_st event;
+        event.time = start;
+        event.duration = end - start;
+        event.task = task;
+        event.type = &type;
+        event.value = run_state;
+        event.kind = task_run;
+        event.base_state = base_state;
+        record(event);
+      }
+    }
+
+    static void task_event(event_type kind, void const* task, uint32_t value)
+    {
+      if (sample())
+      {
+        event_st event;
+        event.time = AITaskAccounting::now();
+        event.duration = 0;
+        event.task = task;
+        event.type = nullptr;
+        event.value = value;
+        event.kind = kind;
+        event.base_state = 0;
+        record(event);
+      }
+    }
+
+    static void engine_event(event_type kind, void const* task, char const* engine_name)
+    {
+      if (sample())
+      {
+        event_st event;
+        event.time = AITaskAccounting::now();
+        event.duration = 0;
+        event.task = task;
+        event.name = engine_name;
+        event.value = 0;
+        event.kind = kind;
+        event.base_state = 0;
+        record(event);
+      }
+    }
+
+    static void job(void const* task, std::type_info const& type, tick_type start, tick_type end)
+    {
+      if (sample())
+      {
+        event_st event;
+        event.time = start;
+        event.duration = end - start;
+        event.task = task;
+        event.type = &type;
+        event.value = 0;
+        event.kind = pool_job;
+        event.base_state = 0;
+        record(event);
+      }
+    }
+};
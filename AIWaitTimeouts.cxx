@@ -0,0 +1,198 @@
+/**
+ * @file
+ * @brief Implementation of AIWaitTimeouts.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#include "sys.h"
+#include "AIWaitTimeouts.h"
+#include <boost/intrusive_ptr.hpp>
+
+//static
+AIWaitTimeouts& AIWaitTimeouts::instance()
+{
+  static AIWaitTimeouts s_instance;
+  return s_instance;
+}
+
+AIWaitTimeouts::~AIWaitTimeouts()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_condition.notify_one();
+  if (m_thread.joinable())
+    m_thread.join();
+}
+
+void AIWaitTimeouts::place(size_t index, timeout_st const& timeout)
+{
+  m_heap[index] = timeout;
+  timeout.task->rare_ptr()->timeout_index = index;
+}
+
+void AIWaitTimeouts::sift_up(size_t index)
+{
+  timeout_st const timeout = m_heap[index];
+  while (index > 0)
+  {
+    size_t const parent = (index - 1) / 2;
+    if (!(timeout.deadline < m_heap[parent].deadline))
+      break;
+    place(index, m_heap[parent]);
+    index = parent;
+  }
+  place(index, timeout);
+}
+
+void AIWaitTimeouts::sift_down(size_t index)
+{
+  timeout_st const timeout = m_heap[index];
+  size_t const size = m_heap.size();
+  for (;;)
+  {
+    size_t child = 2 * index + 1;
+    if (child >= size)
+      break;
+    if (child + 1 < size && m_heap[child + 1].deadline < m_heap[child].deadline)
+      ++child;
+    if (!(m_heap[child].deadline < timeout.deadline))
+      break;
+    place(index, m_heap[child]);
+    index = child;
+  }
+  place(index, timeout);
+}
+
+void AIWaitTimeouts::erase(size_t index)
+{
+  m_heap[index].task->rare_ptr()->timeout_index = AIStatefulTask::no_timeout_index;
+  size_t const last = m_heap.size() - 1;
+  if (index != last)
+  {
+    place(index, m_heap[last]);
+    m_heap.pop_back();
+    // The moved entry can be earlier or later than the one that was removed.
+    if (index > 0 && m_heap[index].deadline < m_heap[(index - 1) / 2].deadline)
+      sift_up(index);
+    else
+      sift_down(index);
+  }
+  else
+    m_heap.pop_back();
+}
+
+//static
+void AIWaitTimeouts::add(clock_type::time_point deadline, AIStatefulTask* task, uint32_t generation, AIStatefulTask::condition_type conditions)
+{
+  AIWaitTimeouts& self(instance());
+  bool new_first;
+  {
+    std::lock_guard<std::mutex> lock(self.m_mutex);
+    if (AI_UNLIKELY(!self.m_thread.joinable()))
+      self.m_thread = std::thread(&AIWaitTimeouts::main, &self);
+    size_t index = task->rare_ptr()->timeout_index;
+    if (index == AIStatefulTask::no_timeout_index)
+    {
+      index = self.m_heap.size();
+      self.m_heap.push_back(timeout_st{deadline, task, generation, conditions});
+      self.sift_up(index);
+    }
+    else
+    {
+      // Replace the timeout that the task already has.
+      bool const earlier = deadline < self.m_heap[index].deadline;
+      self.m_heap[index] = timeout_st{deadline, task, generation, conditions};
+      if (earlier)
+        self.sift_up(index);
+      else
+        self.sift_down(index);
+    }
+    new_first = self.m_heap.front().task == task;
+  }
+  // Only wake up the thread when it has to wait shorter than it is doing now.
+  if (new_first)
+    self.m_condition.notify_one();
+}
+
+//static
+void AIWaitTimeouts::remove(AIStatefulTask* task)
+{
+  AIWaitTimeouts& self(instance());
+  std::lock_guard<std::mutex> lock(self.m_mutex);
+  size_t const index = task->rare_ptr()->timeout_index;
+  if (index != AIStatefulTask::no_timeout_index)
+    self.erase(index);
+}
+
+//static
+size_t AIWaitTimeouts::size()
+{
+  AIWaitTimeouts& self(instance());
+  std::lock_guard<std::mutex> lock(self.m_mutex);
+  return self.m_heap.size();
+}
+
+void AIWaitTimeouts::main()
+{
+  Debug(NAMESPACE_DEBUG::init_thread());
+  Dout(dc::statefultask, "AIWaitTimeouts thread started.");
+  struct expired_st {
+    boost::intrusive_ptr<AIStatefulTask> task;  // Keeps the task alive while it is being signalled.
+    uint32_t generation;
+    AIStatefulTask::condition_type conditions;
+  };
+  std::vector<expired_st> expired;
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (!m_stop)
+  {
+    if (m_heap.empty())
+    {
+      m_condition.wait(lock);
+      continue;
+    }
+    clock_type::time_point const now = clock_type::now();
+    while (!m_heap.empty() && m_heap.front().deadline <= now)
+    {
+      // The reference count of the task is not zero: a task holds a reference to itself while it runs, and it cancels
+      // its timeout before releasing that (see AIStatefulTask::cancel_timeout()), which it can't do while we hold the lock.
+      timeout_st const& timeout(m_heap.front());
+      expired.push_back(expired_st{timeout.task, timeout.generation, timeout.conditions});
+      erase(0);
+    }
+    if (expired.empty())
+    {
+      m_condition.wait_until(lock, m_heap.front().deadline);
+      continue;
+    }
+    // Signal the tasks (and release them) without holding the lock, so that add() and remove() don't block on us.
+    lock.unlock();
+    for (expired_st& timeout : expired)
+      timeout.task->timeout_expired(timeout.generation, timeout.conditions);
+    expired.clear();
+    lock.lock();
+  }
+  Dout(dc::statefultask, "AIWaitTimeouts thread terminated.");
+}
@@ -0,0 +1,90 @@
+/**
+ * @file
+ * @brief The timeouts of wait(conditions, timeout) and wait_until(..., timeout). Declaration of class AIWaitTimeouts.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#pragma once
+
+#include "AIStatefulTask.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// The timeouts of all tasks, in a single binary heap ordered by deadline and handled by a single thread.
+//
+// Each task has at most one entry in the heap and knows where it is (rare_st::timeout_index), so that
+// the entry is removed as soon as the task is woken up before the deadline (see AIStatefulTask::end_timeout()).
+// The heap therefore only contains timeouts that are still pending. It doesn't keep a reference to the
+// tasks: a task that has a pending timeout is running and holds a reference to itself, and it removes
+// the timeout before it releases that, when it finishes or is killed by AIEngine::flush() (see
+// AIStatefulTask::cancel_timeout()). The thread only takes a reference of its own while it signals a task.
+//
+// The thread is started when the first timeout is added and stopped at program exit.
+//
+class AIWaitTimeouts
+{
+  public:
+    using clock_type = std::chrono::steady_clock;
+
+  private:
+    struct timeout_st {
+      clock_type::time_point deadline;
+      AIStatefulTask* task;
+      uint32_t generation;                              // The generation of the timeout (see AIStatefulTask::timeout_expired()).
+      AIStatefulTask::condition_type conditions;        // The conditions passed to wait() (see AIStatefulTask::timeout_expired()).
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<timeout_st> m_heap;                     // A min-heap on deadline. Protected by m_mutex, as are the timeout_index of the tasks in it.
+    std::thread m_thread;                               // Started upon the first call to add().
+    bool m_stop;                                        // Protected by m_mutex.
+
+    AIWaitTimeouts() : m_stop(false) { }
+    ~AIWaitTimeouts();
+    static AIWaitTimeouts& instance();
+    void main();
+
+    // The following are called while m_mutex is locked.
+    void place(size_t index, timeout_st const& timeout);        // Store timeout at index and update the timeout_index of its task.
+    void sift_up(size_t index);
+    void sift_down(size_t index);
+    void erase(size_t index);
+
+  public:
+    // Signal task at deadline, unless the task ran in the meantime (or set a new timeout).
+    // Replaces the timeout of task if it already has one. Called by AIStatefulTask::arm_timeout().
+    static void add(clock_type::time_point deadline, AIStatefulTask* task, uint32_t generation, AIStatefulTask::condition_type conditions);
+
+    // Remove the timeout of task, if it is still in the heap. Called by AIStatefulTask::end_timeout().
+    static void remove(AIStatefulTask* task);
+
+    // Return the current number of timeouts in the heap.
+    static size_t size();
+};
@@ -0,0 +1,253 @@
+/**
+ * @file
+ * @brief Histograms of the latency between signal() and the next run. Implementation of class AIWakeUpLatency.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#include "sys.h"
+#include "AIWakeUpLatency.h"
+#include "AIEngine.h"
+#include "utils/macros.h"
+#include "debug.h"
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <iostream>
+#include <iomanip>
+#include <cxxabi.h>
+#include <cstdlib>
+
+namespace {
+
+struct Histogram {
+  // Only written by the thread that owns them; read by per_engine() and per_task_class().
+  std::atomic<uint64_t> counts[AIWakeUpLatency::number_of_buckets];
+  Histogram() { for (auto& count : counts) count.store(0, std::memory_order_relaxed); }
+
+  void add(AIWakeUpLatency::tick_type ticks)
+  {
+    // Single writer increment; much cheaper than a fetch_add.
+    std::atomic<uint64_t>& count(counts[AIWakeUpLatency::bucket(ticks)]);
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  void add_to(AIWakeUpLatency::histogram_st& histogram) const
+  {
+    for (int b = 0; b < AIWakeUpLatency::number_of_buckets; ++b)
+    {
+      uint64_t const count = counts[b].load(std::memory_order_relaxed);
+      histogram.counts[b] += count;
+      histogram.samples += count;
+    }
+  }
+};
+
+// The histogram of an engine, with a copy of its name: the engine might be destroyed before the histograms are printed.
+struct EngineHistogram {
+  std::string name;
+  Histogram histogram;
+  EngineHistogram(AIEngine const* engine) : name(engine ? engine->name() : "inline") { }
+};
+
+struct ThreadHistograms;
+
+// All ThreadHistograms that currently exist, plus the totals of threads that already exited.
+// Engines are keyed by their serial number (see AIEngine::serial()), which unlike their address is never reused.
+struct Registry {
+  std::mutex mutex;
+  std::set<ThreadHistograms*> threads;
+  std::unordered_map<uint32_t, std::pair<std::string, AIWakeUpLatency::histogram_st>> retired_engines;
+  std::unordered_map<std::type_index, AIWakeUpLatency::histogram_st> retired_classes;
+};
+
+Registry& registry()
+{
+  // Constructed on first use and never destructed, so that threads that exit during static destruction can still use it.
+  static Registry* registry = new Registry;
+  return *registry;
+}
+
+struct ThreadHistograms {
+  // The maps are only changed by the owning thread, while holding mutex.
+  // The owning thread may read them without locking; other threads must lock mutex.
+  std::mutex mutex;
+  std::unordered_map<uint32_t, EngineHistogram> engines;      // Keyed by engine serial number, or AITaskAccounting::no_engine for inline runs.
+  std::unordered_map<std::type_index, Histogram> classes;
+  // The most recently used histograms. Hashing a std::type_index hashes the name of the
+  // type, which is relatively expensive, while most threads run the same task over and over.
+  uint32_t last_engine;
+  Histogram* last_engine_histogram;
+  std::type_info const* last_class;
+  Histogram* last_class_histogram;
+
+  ThreadHistograms() : last_engine(AITaskAccounting::no_engine), last_engine_histogram(nullptr), last_class(nullptr), last_class_histogram(nullptr)
+  {
+    Registry& r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.threads.insert(this);
+  }
+
+  ~ThreadHistograms()
+  {
+    Registry& r(registry());
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (auto& entry : engines)
+    {
+      auto& retired(r.retired_engines[entry.first]);
+      retired.first = entry.second.name;
+      entry.second.histogram.add_to(retired.second);
+    }
+    for (auto& entry : classes)
+      entry.second.add_to(r.retired_classes[entry.first]);
+    r.threads.erase(this);
+  }
+
+  Histogram& get(std::type_index key)
+  {
+    auto iter = classes.find(key);
+    if (!AI_UNLIKELY(iter == classes.end()))
+      return iter->second;
+    // First time this thread sees this task class.
+    std::lock_guard<std::mutex> lock(mutex);
+    return classes.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first->second;
+  }
+
+  Histogram& get(AIEngine const* engine)
+  {
+    uint32_t const serial = engine ? engine->serial() : AITaskAccounting::no_engine;
+    auto iter = engines.find(serial);
+    if (!AI_UNLIKELY(iter == engines.end()))
+      return iter->second.histogram;
+    // First time this thread sees this engine; copy its name while it certainly still exists.
+    std::lock_guard<std::mutex> lock(mutex);
+    return engines.emplace(std::piecewise_construct, std::forward_as_tuple(serial), std::forward_as_tuple(engine)).first->second.histogram;
+  }
+};
+
+thread_local ThreadHistograms t_histograms;
+
+} // namespace
+
+double AIWakeUpLatency::histogram_st::percentile(double fraction) const
+{
+  if (samples == 0)
+    return 0.0;
+  uint64_t const rank = static_cast<uint64_t>(fraction * samples + 0.5);
+  uint64_t sum = 0;
+  int b = 0;
+  for (; b < number_of_buckets - 1; ++b)
+  {
+    sum += counts[b];
+    if (sum >= rank && sum > 0)
+      break;
+  }
+  return bucket_end(b) * AITaskAccounting::nanoseconds_per_tick();
+}
+
+//static
+constexpr int AIWakeUpLatency::number_of_buckets;
+
+//static
+void AIWakeUpLatency::add(AIEngine const* engine, std::type_info const& task_class, tick_type ticks)
+{
+  ThreadHistograms& histograms(t_histograms);
+  uint32_t const serial = engine ? engine->serial() : AITaskAccounting::no_engine;
+  if (AI_UNLIKELY(!histograms.last_engine_histogram || serial != histograms.last_engine))
+  {
+    histograms.last_engine = serial;
+    histograms.last_engine_histogram = &histograms.get(engine);
+  }
+  if (AI_UNLIKELY(&task_class != histograms.last_class))
+  {
+    histograms.last_class = &task_class;
+    histograms.last_class_histogram = &histograms.get(std::type_index(task_class));
+  }
+  histograms.last_engine_histogram->add(ticks);
+  histograms.last_class_histogram->add(ticks);
+}
+
+//static
+std::map<std::string, AIWakeUpLatency::histogram_st> AIWakeUpLatency::per_engine()
+{
+  std::map<std::string, histogram_st> result;
+  Registry& r(registry());
+  std::lock_guard<std::mutex> registry_lock(r.mutex);
+  // Only the names that were copied when the histograms were created are used; the engines themselves might be gone.
+  for (auto& entry : r.retired_engines)
+  {
+    histogram_st& histogram(result[entry.second.first]);
+    for (int b = 0; b < number_of_buckets; ++b)
+      histogram.counts[b] += entry.second.second.counts[b];
+    histogram.samples += entry.second.second.samples;
+  }
+  for (ThreadHistograms* thread_histograms : r.threads)
+  {
+    std::lock_guard<std::mutex> lock(thread_histograms->mutex);
+    for (auto& entry : thread_histograms->engines)
+      entry.second.histogram.add_to(result[entry.second.name]);
+  }
+  return result;
+}
+
+//static
+std::map<std::type_index, AIWakeUpLatency::histogram_st> AIWakeUpLatency::per_task_class()
+{
+  std::map<std::type_index, histogram_st> result;
+  Registry& r(registry());
+  std::lock_guard<std::mutex> registry_lock(r.mutex);
+  for (auto& entry : r.retired_classes)
+    result[entry.first] = entry.second;
+  for (ThreadHistograms* thread_histograms : r.threads)
+  {
+    std::lock_guard<std::mutex> lock(thread_histograms->mutex);
+    for (auto& entry : thread_histograms->classes)
+      entry.second.add_to(result[entry.first]);
+  }
+  return result;
+}
+
+//static
+void AIWakeUpLatency::print_on(std::ostream& os)
+{
+  auto print = [&os](std::string const& name, histogram_st const& histogram) {
+    os << std::setw(40) << std::left << name << std::right << " samples: " << std::setw(10) << histogram.samples;
+    static double const fractions[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    static char const* const labels[] = { "p50", "p90", "p99", "p99.9", "max" };
+    for (int i = 0; i < 5; ++i)
+      os << "; " << labels[i] << ": " << std::setw(10) << static_cast<uint64_t>(histogram.percentile(fractions[i])) << " ns";
+    os << '\n';
+  };
+  os << "Wake-up latency per engine:\n";
+  for (auto& entry : per_engine())
+    print(entry.first, entry.second);
+  os << "Wake-up latency per task class:\n";
+  for (auto& entry : per_task_class())
+  {
+    int status;
+    char* demangled = abi::__cxa_demangle(entry.first.name(), nullptr, nullptr, &status);
+    print(status == 0 ? demangled : entry.first.name(), entry.second);
+    std::free(demangled);
+  }
+}
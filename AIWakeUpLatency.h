@@ -0,0 +1,102 @@
+/**
+ * @file
+ * @brief Histograms of the latency between signal() and the next run. Declaration of class AIWakeUpLatency.
+ *
+ * Copyright (C) 2026  agent <agent@local>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * CHANGELOG
+ *   and additional copyright holders.
+ *
+ *   2026/10/19
+ *   - Initial version, written by agent.
+ */
+
+
+#pragma once
+
+#include "AITaskAccounting.h"
+#include <map>
+#include <string>
+#include <iosfwd>
+#include <typeinfo>
+#include <typeindex>
+#include <cstdint>
+
+class AIEngine;
+
+// Histograms of the wake-up latency of tasks: the time between a call to signal()
+// that makes an idle task runnable and the start of the next run of that task.
+// This includes the time that the task spent in the queue of an engine.
+//
+// Every latency is added to the histogram of the engine that ran the task ("inline"
+// when it was run directly by the thread that called signal()) and to the histogram
+// of the class of the task. Like AITaskAccounting, the histograms are kept per thread
+// and per_engine() and per_task_class() sum them up; they may be called at any time.
+//
+// The buckets are logarithmic with four buckets per power of two, so
+// percentiles are accurate to within 25%.
+//
+// Usage:
+//
+// AIWakeUpLatency::print_on(std::cout);       // Print the percentiles per engine and per task class.
+//
+class AIWakeUpLatency
+{
+  public:
+    using tick_type = AITaskAccounting::tick_type;
+
+    static constexpr int number_of_buckets = 252;       // Enough for any 64-bit number of ticks.
+
+    struct histogram_st {
+      uint64_t counts[number_of_buckets];               // The number of latencies per bucket, see bucket().
+      uint64_t samples;                                 // The sum of counts.
+      histogram_st() : counts(), samples(0) { }
+
+      // Return the latency in nanoseconds below which a fraction `fraction' of the samples lie (the upper bound of the bucket).
+      double percentile(double fraction) const;
+    };
+
+    // Return the bucket that a latency of `ticks' belongs to.
+    static int bucket(tick_type ticks)
+    {
+      if (ticks < 4)
+        return ticks;
+      int const msb = 63 - __builtin_clzll(ticks);
+      return (msb - 1) * 4 + ((ticks >> (msb - 2)) & 3);
+    }
+
+    // Return the smallest number of ticks that does not belong to bucket `b' anymore.
+    static double bucket_end(int b)
+    {
+      if (b < 4)
+        return b + 1;
+      int const msb = b / 4 + 1;
+      return static_cast<double>((4 + b % 4 + 1)) * static_cast<double>(uint64_t(1) << (msb - 2));
+    }
+
+    // Add a latency of `ticks' for a task of class `task_class' that was run by `engine' (or nullptr when it was run inline).
+    static void add(AIEngine const* engine, std::type_info const& task_class, tick_type ticks);
+
+    // Return the histograms per engine name ("inline" for tasks that were run by the thread that called signal()).
+    // This includes engines that were destroyed since; their name is copied when they first run a task.
+    static std::map<std::string, histogram_st> per_engine();
+
+    // Return the histograms per task class.
+    static std::map<std::type_index, histogram_st> per_task_class();
+
+    // Write the percentiles of all histograms in human readable form to os.
+    static void print_on(std::ostream& os);
+};
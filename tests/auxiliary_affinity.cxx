@@ -0,0 +1,159 @@
+// Test of the affinity policy of AIAuxiliaryThread.
+//
+// A number of tasks without an engine hand a "job" to one of two worker threads after every
+// run; the worker signals the task when it is done. With the affinity policy the task must
+// not continue in the worker thread, but return to the auxiliary thread that it ran in before.
+// The test fails if a task ever runs in another thread than the one of its first run.
+// The timing comparison with the least_loaded policy is tests/benchmark_auxiliary_affinity.
+
+#include "sys.h"
+#include "AIStatefulTask.h"
+#include "AIEngine.h"
+#include "AIAuxiliaryThread.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int const number_of_tasks = 8;
+int const number_of_auxiliary_threads = 4;
+int const number_of_workers = 2;
+long const runs_per_task = 200;
+
+class Worker;
+
+// The "thread pool": worker threads that signal the tasks in jobs.
+std::mutex jobs_mutex;
+std::condition_variable jobs_cv;
+std::deque<Worker*> jobs;
+bool jobs_done;
+
+std::atomic<int> finished;               // The number of tasks that finished.
+
+class Worker : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~Worker() override { }
+
+    enum worker_state_type {
+      Worker_start = direct_base_type::max_state,
+      Worker_work
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(Worker_start);
+        AI_CASE_RETURN(Worker_work);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type run_state) override
+    {
+      switch (run_state)
+      {
+        case Worker_start:
+          set_state(Worker_work);
+          yield();                      // Get into an auxiliary thread.
+          break;
+        case Worker_work:
+        {
+          std::thread::id const id = std::this_thread::get_id();
+          if (m_runs++ && id != m_last_thread)
+            ++m_migrations;
+          m_last_thread = id;
+          if (m_runs == runs_per_task)
+          {
+            finish();
+            break;
+          }
+          {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            jobs.push_back(this);
+          }
+          jobs_cv.notify_one();
+          wait(1);
+          break;
+        }
+      }
+    }
+
+  public:
+    static state_type const max_state = Worker_work + 1;
+    Worker() : AIStatefulTask(DEBUG_ONLY(false)), m_runs(0), m_migrations(0) { }
+
+    long m_runs;
+    long m_migrations;
+    std::thread::id m_last_thread;
+};
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIAuxiliaryThread::start(number_of_auxiliary_threads, AIAuxiliaryThread::affinity);
+  jobs_done = false;
+  finished = 0;
+  std::vector<boost::intrusive_ptr<Worker>> tasks;
+  for (int i = 0; i < number_of_tasks; ++i)
+  {
+    tasks.emplace_back(new Worker);
+    tasks.back()->run([](bool){ ++finished; }, nullptr);
+  }
+  std::vector<std::thread> workers;
+  for (int t = 0; t < number_of_workers; ++t)
+    workers.emplace_back([](){
+        for (;;)
+        {
+          Worker* task;
+          {
+            std::unique_lock<std::mutex> lock(jobs_mutex);
+            jobs_cv.wait(lock, [](){ return !jobs.empty() || jobs_done; });
+            if (jobs.empty())
+              return;
+            task = jobs.front();
+            jobs.pop_front();
+          }
+          task->signal(1);
+        }
+      });
+  // Give up after 30 seconds.
+  auto const start = std::chrono::steady_clock::now();
+  while (finished < number_of_tasks && std::chrono::steady_clock::now() - start < std::chrono::seconds(30))
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  {
+    std::lock_guard<std::mutex> lock(jobs_mutex);
+    jobs_done = true;
+  }
+  jobs_cv.notify_all();
+  for (std::thread& worker : workers)
+    worker.join();
+  AIAuxiliaryThread::stop();
+
+  if (finished != number_of_tasks)
+  {
+    std::cerr << "FAIL: " << finished << " of " << number_of_tasks << " tasks finished." << std::endl;
+    return 1;
+  }
+  long migrations = 0;
+  for (auto& task : tasks)
+    migrations += task->m_migrations;
+  if (migrations != 0)
+  {
+    std::cerr << "FAIL: tasks migrated " << migrations << " times with the affinity policy." << std::endl;
+    return 1;
+  }
+  std::cout << "OK: " << number_of_tasks * runs_per_task << " runs without migrations." << std::endl;
+  return 0;
+}
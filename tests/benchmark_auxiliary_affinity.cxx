@@ -0,0 +1,179 @@
+// Benchmark of the affinity policy of AIAuxiliaryThread.
+//
+// A number of tasks without an engine, each touching its own 64 kB of data per run, hand a
+// "job" to one of two worker threads after every run; the worker signals the task when it
+// is done. With the least_loaded policy the task then continues in the worker thread or in
+// whatever auxiliary thread has the shortest queue; with the affinity policy it always
+// returns to the same auxiliary thread. Prints the number of migrations and the wall clock
+// time for both policies. The functional test of the policy is tests/auxiliary_affinity.
+//
+// Usage: tests/benchmark_auxiliary_affinity [runs_per_task]     (default 5000)
+
+#include "sys.h"
+#include "AIStatefulTask.h"
+#include "AIEngine.h"
+#include "AIAuxiliaryThread.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int const number_of_tasks = 8;
+int const number_of_auxiliary_threads = 4;
+int const number_of_workers = 2;
+long runs_per_task = 5000;
+
+class Worker;
+
+// The "thread pool": worker threads that signal the tasks in jobs.
+std::mutex jobs_mutex;
+std::condition_variable jobs_cv;
+std::deque<Worker*> jobs;
+bool jobs_done;
+
+std::atomic<int> finished;               // The number of tasks that finished.
+
+class Worker : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~Worker() override { }
+
+    enum worker_state_type {
+      Worker_start = direct_base_type::max_state,
+      Worker_work
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(Worker_start);
+        AI_CASE_RETURN(Worker_work);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type run_state) override
+    {
+      switch (run_state)
+      {
+        case Worker_start:
+          set_state(Worker_work);
+          yield();                      // Get into an auxiliary thread.
+          break;
+        case Worker_work:
+        {
+          std::thread::id const id = std::this_thread::get_id();
+          if (m_runs++ && id != m_last_thread)
+            ++m_migrations;
+          m_last_thread = id;
+          for (size_t i = 0; i < m_data.size(); i += 16)
+            m_sum += ++m_data[i];
+          if (m_runs == runs_per_task)
+          {
+            finish();
+            break;
+          }
+          {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            jobs.push_back(this);
+          }
+          jobs_cv.notify_one();
+          wait(1);
+          break;
+        }
+      }
+    }
+
+  public:
+    static state_type const max_state = Worker_work + 1;
+    Worker() : AIStatefulTask(DEBUG_ONLY(false)), m_data(64 * 1024 / sizeof(unsigned)), m_sum(0), m_runs(0), m_migrations(0) { }
+
+    std::vector<unsigned> m_data;
+    unsigned m_sum;
+    long m_runs;
+    long m_migrations;
+    std::thread::id m_last_thread;
+};
+
+struct result_st {
+  long migrations;
+  double milliseconds;
+  bool finished;
+};
+
+result_st benchmark(AIAuxiliaryThread::policy_type policy)
+{
+  AIAuxiliaryThread::start(number_of_auxiliary_threads, policy);
+  jobs_done = false;
+  finished = 0;
+  std::vector<boost::intrusive_ptr<Worker>> tasks;
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < number_of_tasks; ++i)
+  {
+    tasks.emplace_back(new Worker);
+    tasks.back()->run([](bool){ ++finished; }, nullptr);
+  }
+  std::vector<std::thread> workers;
+  for (int t = 0; t < number_of_workers; ++t)
+    workers.emplace_back([](){
+        for (;;)
+        {
+          Worker* task;
+          {
+            std::unique_lock<std::mutex> lock(jobs_mutex);
+            jobs_cv.wait(lock, [](){ return !jobs.empty() || jobs_done; });
+            if (jobs.empty())
+              return;
+            task = jobs.front();
+            jobs.pop_front();
+          }
+          task->signal(1);
+        }
+      });
+  // Give up after 30 seconds.
+  while (finished < number_of_tasks && std::chrono::steady_clock::now() - start < std::chrono::seconds(30))
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+  {
+    std::lock_guard<std::mutex> lock(jobs_mutex);
+    jobs_done = true;
+  }
+  jobs_cv.notify_all();
+  for (std::thread& worker : workers)
+    worker.join();
+  AIAuxiliaryThread::stop();
+  result_st result = { 0, elapsed.count(), finished == number_of_tasks };
+  for (auto& task : tasks)
+    result.migrations += task->m_migrations;
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  if (argc > 1)
+    runs_per_task = std::atol(argv[1]);
+  result_st const least_loaded = benchmark(AIAuxiliaryThread::least_loaded);
+  result_st const affinity = benchmark(AIAuxiliaryThread::affinity);
+  long const runs = number_of_tasks * runs_per_task;
+  std::cout << "least_loaded: " << least_loaded.migrations << " of " << runs << " runs migrated, " << least_loaded.milliseconds << " ms." << std::endl;
+  std::cout << "affinity:     " << affinity.migrations << " of " << runs << " runs migrated, " << affinity.milliseconds << " ms." << std::endl;
+  if (!least_loaded.finished || !affinity.finished)
+  {
+    std::cerr << "WARNING: not all tasks finished within 30 seconds." << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,108 @@
+// Benchmark of the call back passed to run(): boost::signals2 slot versus AICompletionCallback.
+//
+// Creates a task that finishes in its first run, runs it inline (without engine) and lets it
+// call its call back; this is repeated for both forms of run(). Prints the time per
+// new + run() + call back, and the number of memory allocations per task, including the
+// one for the task itself.
+//
+// Usage: tests/benchmark_completion_callback [tasks]  (default 500000; best of 5 runs)
+
+#include "sys.h"
+#include "AIStatefulTask.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+namespace {
+
+std::atomic<long> allocations(0);
+long callbacks;
+
+class Quick : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~Quick() override { }
+
+    enum quick_state_type {
+      Quick_done = direct_base_type::max_state
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(Quick_done);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type) override { finish(); }
+
+  public:
+    static state_type const max_state = Quick_done + 1;
+    Quick() : AIStatefulTask(DEBUG_ONLY(false)) { }
+};
+
+struct result_st {
+  double nanoseconds;
+  double allocations;
+};
+
+result_st run_once(long tasks, bool use_signals2)
+{
+  callbacks = 0;
+  long const before = allocations;
+  auto const start = std::chrono::steady_clock::now();
+  for (long i = 0; i < tasks; ++i)
+  {
+    if (use_signals2)
+      (new Quick)->run(boost::signals2::signal<void (bool)>::slot_type([](bool){ ++callbacks; }), nullptr);
+    else
+      (new Quick)->run([](bool){ ++callbacks; }, nullptr);
+  }
+  std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+  if (callbacks != tasks)
+    std::cerr << "WARNING: " << callbacks << " call backs for " << tasks << " tasks." << std::endl;
+  return { elapsed.count() / tasks, double(allocations - before) / tasks };
+}
+
+} // namespace
+
+void* operator new(size_t size)
+{
+  ++allocations;
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
+int main(int argc, char* argv[])
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  long const tasks = argc > 1 ? std::atol(argv[1]) : 500000;
+  for (int form = 0; form < 2; ++form)
+  {
+    bool const use_signals2 = form == 1;
+    result_st best = run_once(tasks, use_signals2);
+    for (int i = 1; i < 5; ++i)
+      best.nanoseconds = std::min(best.nanoseconds, run_once(tasks, use_signals2).nanoseconds);
+    std::cout << (use_signals2 ? "boost::signals2 slot: " : "AICompletionCallback: ") << best.nanoseconds << " ns and " <<
+        best.allocations << " allocations per task (best of 5 times " << tasks << " tasks)." << std::endl;
+  }
+  return 0;
+}
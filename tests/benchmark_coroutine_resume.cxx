@@ -0,0 +1,144 @@
+// Benchmark of the resume cost of AICoroutineTask versus a task with a hand written multiplex_impl().
+//
+// Both tasks run without engine and go back to waiting on condition 1 on every run, so that
+// every cycle is a signal() that runs the task inline: wait(1) in the switch based task,
+// co_await wait_for(1) in the coroutine. Also prints the cost of new + run() of a coroutine
+// task that returns at once, which includes allocating its frame from the slab allocator.
+//
+// Usage: tests/benchmark_coroutine_resume [cycles]    (default 5000000; best of 5 runs)
+
+#include "sys.h"
+#include "AICoroutineTask.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#ifndef AI_HAVE_COROUTINE_TASK
+#error "AICoroutineTask.h defined nothing: this file must be compiled with coroutine support (-std=c++20)."
+#endif
+
+namespace {
+
+class SwitchPing : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~SwitchPing() override { }
+
+    enum switch_ping_state_type {
+      SwitchPing_wait = direct_base_type::max_state
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(SwitchPing_wait);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type) override
+    {
+      if (m_stop)
+      {
+        finish();
+        return;
+      }
+      ++m_count;
+      wait(1);
+    }
+
+  public:
+    static state_type const max_state = SwitchPing_wait + 1;
+    SwitchPing() : AIStatefulTask(DEBUG_ONLY(false)), m_count(0), m_stop(false) { }
+
+    long m_count;
+    bool m_stop;
+};
+
+class CoroutinePing : public AICoroutineTask {
+  protected:
+    ~CoroutinePing() override { }
+
+    coroutine run_coroutine() override
+    {
+      while (!m_stop)
+      {
+        ++m_count;
+        co_await wait_for(1);
+      }
+    }
+
+  public:
+    CoroutinePing() : AICoroutineTask(DEBUG_ONLY(false)), m_count(0), m_stop(false) { }
+
+    long m_count;
+    bool m_stop;
+};
+
+class CoroutineEmpty : public AICoroutineTask {
+  protected:
+    ~CoroutineEmpty() override { }
+
+    coroutine run_coroutine() override
+    {
+      co_return;
+    }
+
+  public:
+    CoroutineEmpty() : AICoroutineTask(DEBUG_ONLY(false)) { }
+};
+
+// Return the number of nanoseconds per signal() + resume + wait.
+template<class T>
+double resume(long cycles)
+{
+  boost::intrusive_ptr<T> ping = new T;
+  ping->run(nullptr);
+  auto const start = std::chrono::steady_clock::now();
+  for (long i = 0; i < cycles; ++i)
+    ping->signal(1);
+  std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+  ping->m_stop = true;
+  ping->signal(1);
+  if (ping->m_count != cycles + 1 || !ping->finished())
+    std::cerr << "WARNING: " << ping->m_count << " runs for " << cycles << " signals." << std::endl;
+  return elapsed.count() / cycles;
+}
+
+// Return the number of nanoseconds per new + run() of a coroutine task that returns at once.
+double start_and_finish(long tasks)
+{
+  auto const start = std::chrono::steady_clock::now();
+  for (long i = 0; i < tasks; ++i)
+  {
+    boost::intrusive_ptr<CoroutineEmpty> task = new CoroutineEmpty;
+    task->run(nullptr);
+  }
+  std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / tasks;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  long const cycles = argc > 1 ? std::atol(argv[1]) : 5000000;
+  double switch_ns = resume<SwitchPing>(cycles);
+  double coroutine_ns = resume<CoroutinePing>(cycles);
+  double empty_ns = start_and_finish(cycles / 5);
+  for (int i = 1; i < 5; ++i)
+  {
+    switch_ns = std::min(switch_ns, resume<SwitchPing>(cycles));
+    coroutine_ns = std::min(coroutine_ns, resume<CoroutinePing>(cycles));
+    empty_ns = std::min(empty_ns, start_and_finish(cycles / 5));
+  }
+  std::cout << "resume, multiplex_impl(): " << switch_ns << " ns per cycle." << std::endl;
+  std::cout << "resume, coroutine:        " << coroutine_ns << " ns per cycle." << std::endl;
+  std::cout << "start + finish of an empty coroutine task: " << empty_ns << " ns." << std::endl;
+  return 0;
+}
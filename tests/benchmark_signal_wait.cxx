@@ -0,0 +1,84 @@
+// Benchmark of the uncontended signal() -> multiplex_impl() -> wait() round trip.
+//
+// A task without engine is woken up by signal() and goes back to wait() on every run,
+// so that every cycle runs inline in the signalling thread and costs one signal(), one
+// multiplex() with one call to multiplex_impl(), and one wait(). This is the path that
+// the atomic control word (see AIStatefulTask::control_bits) is meant to keep cheap.
+//
+// Usage: tests/benchmark_signal_wait [cycles]         (default 5000000; best of 7 runs)
+
+#include "sys.h"
+#include "AIStatefulTask.h"
+#include "AIEngine.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+class Ping : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~Ping() override { }
+
+    enum ping_state_type {
+      Ping_wait = direct_base_type::max_state
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(Ping_wait);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type) override
+    {
+      if (m_stop)
+      {
+        finish();
+        return;
+      }
+      ++m_count;
+      wait(1);
+    }
+
+  public:
+    static state_type const max_state = Ping_wait + 1;
+    Ping() : AIStatefulTask(DEBUG_ONLY(false)), m_count(0), m_stop(false) { }
+
+    long m_count;
+    bool m_stop;
+};
+
+// Return the number of nanoseconds per cycle.
+double run_once(long cycles)
+{
+  boost::intrusive_ptr<Ping> ping = new Ping;
+  ping->run(nullptr);
+  auto const start = std::chrono::steady_clock::now();
+  for (long i = 0; i < cycles; ++i)
+    ping->signal(1);
+  std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+  ping->m_stop = true;
+  ping->signal(1);
+  return elapsed.count() / cycles;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  long const cycles = argc > 1 ? std::atol(argv[1]) : 5000000;
+  double best = run_once(cycles);
+  for (int i = 1; i < 7; ++i)
+    best = std::min(best, run_once(cycles));
+  std::cout << "signal() + run + wait(): " << best << " ns per cycle (best of 7 times " << cycles << " cycles)." << std::endl;
+  return 0;
+}
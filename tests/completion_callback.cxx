@@ -0,0 +1,165 @@
+// Test of AICompletionCallback and of the run() overload that takes one.
+//
+// Checks that small callables are stored without allocating memory, that large ones and ones
+// that can throw while being moved are stored on the heap, that every stored callable is
+// destroyed exactly once however the callback is moved around, and that a task calls a
+// move-only call back passed to run() exactly once.
+
+#include "sys.h"
+#include "AIStatefulTask.h"
+#include "AICompletionCallback.h"
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+
+namespace {
+
+std::atomic<int> allocations(0);
+
+// Counts its live instances, so that a missing or double destruction shows up.
+struct Counted
+{
+  static int s_live;
+  int* m_calls;
+  Counted(int* calls) : m_calls(calls) { ++s_live; }
+  Counted(Counted const& other) : m_calls(other.m_calls) { ++s_live; }
+  Counted(Counted&& other) noexcept : m_calls(other.m_calls) { ++s_live; }
+  ~Counted() { --s_live; }
+  void operator()(bool success) { if (success) ++*m_calls; }
+};
+int Counted::s_live;
+
+struct Large : public Counted
+{
+  char m_padding[4 * sizeof(void*)];
+  Large(int* calls) : Counted(calls) { }
+};
+
+struct ThrowingMove : public Counted
+{
+  ThrowingMove(int* calls) : Counted(calls) { }
+  ThrowingMove(ThrowingMove&& other) : Counted(other) { }
+};
+
+// A move-only call back.
+struct MoveOnly
+{
+  std::unique_ptr<int> m_token;
+  int* m_calls;
+  bool* m_success;
+  MoveOnly(std::unique_ptr<int>&& token, int* calls, bool* success) : m_token(std::move(token)), m_calls(calls), m_success(success) { }
+  void operator()(bool success) { ++*m_calls; *m_success = success && *m_token == 42; }
+};
+
+class Task : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~Task() override { }
+
+    enum task_state_type {
+      Task_done = direct_base_type::max_state
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(Task_done);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type) override { finish(); }
+
+  public:
+    static state_type const max_state = Task_done + 1;
+    Task() : AIStatefulTask(DEBUG_ONLY(false)) { }
+};
+
+// Store a F in a callback, move it twice, call it and destroy it; return the number of allocations this did.
+template<typename F>
+int round_trip(int& calls)
+{
+  int const before = allocations;
+  {
+    AICompletionCallback callback{F(&calls)};
+    AICompletionCallback moved(std::move(callback));
+    AICompletionCallback assigned;
+    assigned = std::move(moved);
+    if (callback || moved || !assigned)
+      return -1;
+    assigned(true);
+  }
+  return allocations - before;
+}
+
+} // namespace
+
+void* operator new(size_t size)
+{
+  ++allocations;
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  int calls = 0;
+  int const inline_allocations = round_trip<Counted>(calls);
+  int const large_allocations = round_trip<Large>(calls);
+  int const throwing_allocations = round_trip<ThrowingMove>(calls);
+  if (inline_allocations != 0 || large_allocations != 1 || throwing_allocations != 1)
+  {
+    std::cerr << "FAIL: expected 0, 1 and 1 allocations, got " << inline_allocations << ", " << large_allocations << " and " << throwing_allocations << '.' << std::endl;
+    return 1;
+  }
+  if (calls != 3 || Counted::s_live != 0)
+  {
+    std::cerr << "FAIL: " << calls << " calls and " << Counted::s_live << " live callables, expected 3 and 0." << std::endl;
+    return 1;
+  }
+
+  // A lambda that captures three pointers must still fit.
+  int a = 0, b = 0, c = 0;
+  int const before = allocations;
+  {
+    AICompletionCallback callback([&a, &b, &c](bool success){ a += success; b += success; c += success; });
+    callback(true);
+  }
+  if (allocations != before || a + b + c != 3)
+  {
+    std::cerr << "FAIL: a lambda capturing three references allocated " << (allocations - before) << " times." << std::endl;
+    return 1;
+  }
+
+  // Let a task call a move-only call back; with a nullptr engine it runs to completion inside run().
+  int task_calls = 0;
+  bool task_success = false;
+  boost::intrusive_ptr<Task> task = new Task;
+  task->run(MoveOnly(std::unique_ptr<int>(new int(42)), &task_calls, &task_success), nullptr);
+  task.reset();
+  if (task_calls != 1 || !task_success)
+  {
+    std::cerr << "FAIL: the call back passed to run() was called " << task_calls << " times (success: " << task_success << ")." << std::endl;
+    return 1;
+  }
+
+  std::cout << "OK: inline and heap stored call backs." << std::endl;
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Compile check for AICoroutineTask.h, which is only used from translation units that are
+// compiled as C++20 (the library itself is C++11). It uses every awaitable once, so that a
+// change that breaks the header is noticed by `make check' instead of by the first user.
+
+#include "sys.h"
+#include "AICoroutineTask.h"
+#include "AIEngine.h"
+#include "AIAuxiliaryThread.h"
+
+#ifndef AI_HAVE_COROUTINE_TASK
+#error "AICoroutineTask.h defined nothing: this file must be compiled with coroutine support (-std=c++20)."
+#endif
+
+namespace {
+
+int square(int n)
+{
+  return n * n;
+}
+
+class ChildTask : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~ChildTask() override { }
+
+    enum child_task_state_type {
+      ChildTask_start = direct_base_type::max_state
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(ChildTask_start);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type) override
+    {
+      finish();
+    }
+
+  public:
+    static state_type const max_state = ChildTask_start + 1;
+    ChildTask() : AIStatefulTask(DEBUG_ONLY(false)) { }
+};
+
+class CompileTask : public AICoroutineTask {
+  protected:
+    ~CompileTask() override { }
+
+    coroutine run_coroutine() override
+    {
+      m_square(5);
+      int result = co_await job(m_square);
+      co_await switch_to(&gAuxiliaryThreadEngine);
+      co_await yield_now();
+      if (!co_await child(new ChildTask, 2))
+      {
+        abort();
+        co_return;
+      }
+      if (result != 25)
+        co_await wait_for(4);
+    }
+
+  public:
+    CompileTask(int queue_handle) : AICoroutineTask(DEBUG_ONLY(false)), m_square(this, 1, &square, queue_handle) { }
+
+  private:
+    AIPackagedTask<int(int)> m_square;
+};
+
+} // namespace
+
+// Referenced, so that the compiler has to instantiate everything.
+AIStatefulTask* coroutine_task_compile_check(int queue_handle)
+{
+  return new CompileTask(queue_handle);
+}
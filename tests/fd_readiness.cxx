@@ -0,0 +1,147 @@
+// Test for the file descriptor readiness mode of AIEngine (see AIEngine::enable_fd_readiness()).
+//
+// A task waits on one end of a socketpair while gAuxiliaryThreadEngine has nothing else to do,
+// so that its thread is parked in epoll_wait(). Every byte written to the other end must wake up
+// that thread and signal the task, without any polling.
+
+#include "sys.h"
+#include "AIStatefulTask.h"
+#include "AIEngine.h"
+#include "AIAuxiliaryThread.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+namespace {
+
+int const number_of_bytes = 3;
+
+std::atomic<int> bytes_read(0);
+std::atomic<int> result(0);             // 1: success, 2: aborted.
+
+class Reader : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~Reader() override { }
+
+    enum reader_state_type {
+      Reader_arm = direct_base_type::max_state,
+      Reader_read
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(Reader_arm);
+        AI_CASE_RETURN(Reader_read);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type run_state) override
+    {
+      switch (run_state)
+      {
+        case Reader_arm:
+          if (!gAuxiliaryThreadEngine.watch_fd(m_fd, EPOLLIN, this, 1))
+          {
+            abort();
+            break;
+          }
+          set_state(Reader_read);
+          wait(1);
+          break;
+        case Reader_read:
+        {
+          char buf[16];
+          ssize_t n = read(m_fd, buf, sizeof(buf));
+          if (n > 0)
+            bytes_read += n;
+          if (bytes_read < number_of_bytes)
+          {
+            set_state(Reader_arm);
+            break;
+          }
+          gAuxiliaryThreadEngine.unwatch_fd(m_fd);
+          finish();
+          break;
+        }
+      }
+    }
+
+  public:
+    static state_type const max_state = Reader_read + 1;
+    Reader(int fd) : AIStatefulTask(DEBUG_ONLY(false)), m_fd(fd) { }
+
+  private:
+    int m_fd;
+};
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  if (!gAuxiliaryThreadEngine.enable_fd_readiness())
+  {
+    std::cerr << "FAIL: enable_fd_readiness() failed." << std::endl;
+    return 1;
+  }
+  AIAuxiliaryThread::start();
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+  {
+    std::cerr << "FAIL: socketpair() failed." << std::endl;
+    return 1;
+  }
+  boost::intrusive_ptr<Reader> reader(new Reader(sv[0]));
+  reader->run([](bool success){ result = success ? 1 : 2; }, &gAuxiliaryThreadEngine);
+
+  for (int i = 0; i < number_of_bytes; ++i)
+  {
+    // Give the engine the time to park in epoll_wait().
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    int const before = bytes_read;
+    auto const start = std::chrono::steady_clock::now();
+    if (write(sv[1], "x", 1) != 1)
+    {
+      std::cerr << "FAIL: write() failed." << std::endl;
+      return 1;
+    }
+    while (bytes_read == before && std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    if (bytes_read == before)
+    {
+      std::cerr << "FAIL: byte " << i << " didn't wake up the engine." << std::endl;
+      return 1;
+    }
+  }
+  for (int i = 0; result == 0 && i < 5000; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  AIEngine::statistics_st const statistics = gAuxiliaryThreadEngine.statistics();
+  AIAuxiliaryThread::stop();
+  close(sv[0]);
+  close(sv[1]);
+
+  if (result != 1)
+  {
+    std::cerr << "FAIL: the reader " << (result == 0 ? "didn't finish." : "was aborted.") << std::endl;
+    return 1;
+  }
+  if (statistics.parked_duration < std::chrono::milliseconds(number_of_bytes * 10))
+  {
+    std::cerr << "FAIL: the engine didn't park while waiting for the socket." << std::endl;
+    return 1;
+  }
+  std::cout << "OK: " << bytes_read << " bytes read, " << statistics.tasks_run << " runs." << std::endl;
+  return 0;
+}
@@ -0,0 +1,147 @@
+// Stress test for the control word of AIStatefulTask (see AIStatefulTask::control_bits).
+//
+// Several threads signal the same tasks concurrently while another thread aborts some of them,
+// half of the tasks running in the auxiliary engines and half in whatever thread signals them.
+// A lost signal makes a task wait forever, and every task must have its call back called exactly
+// once, with success == false if and only if it was aborted.
+
+#include "sys.h"
+#include "AIStatefulTask.h"
+#include "AIEngine.h"
+#include "AIAuxiliaryThread.h"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int const number_of_tasks = 64;
+int const number_of_signalling_threads = 4;
+long const signals_per_thread = 320 * number_of_tasks;   // A multiple of number_of_tasks, so every task gets the same number of signals.
+
+class Sink : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~Sink() override { }
+
+    enum sink_state_type {
+      Sink_wait = direct_base_type::max_state
+    };
+
+    char const* state_str_impl(state_type run_state) const override
+    {
+      switch (run_state)
+      {
+        AI_CASE_RETURN(Sink_wait);
+      }
+      ASSERT(false);
+      return "UNKNOWN STATE";
+    }
+
+    void multiplex_impl(state_type) override
+    {
+      // The signals are only counted after the corresponding increment of m_produced, so this can't miss the last one.
+      if (m_produced.load(std::memory_order_acquire) < m_total)
+      {
+        wait(1);
+        return;
+      }
+      finish();
+    }
+
+  public:
+    static state_type const max_state = Sink_wait + 1;
+    Sink(long total) : AIStatefulTask(DEBUG_ONLY(false)), m_total(total), m_produced(0), m_callbacks(0), m_success(false), m_aborted(false) { }
+
+    long const m_total;
+    std::atomic<long> m_produced;
+    std::atomic<int> m_callbacks;
+    std::atomic<bool> m_success;
+    std::atomic<bool> m_aborted;        // Set before this task is aborted.
+};
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  AIAuxiliaryThread::start(2, AIAuxiliaryThread::least_loaded);
+
+  long const total = number_of_signalling_threads * signals_per_thread / number_of_tasks;
+  std::vector<boost::intrusive_ptr<Sink>> tasks;
+  for (int i = 0; i < number_of_tasks; ++i)
+  {
+    tasks.emplace_back(new Sink(total));
+    Sink* task = tasks.back().get();
+    task->run([task](bool success){ task->m_success = success; ++task->m_callbacks; }, (i & 1) ? &gAuxiliaryThreadEngine : nullptr);
+  }
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < number_of_signalling_threads; ++t)
+    threads.emplace_back([&tasks, t](){
+        for (long i = 0; i < signals_per_thread; ++i)
+        {
+          Sink& task(*tasks[(i + t) % number_of_tasks]);
+          task.m_produced.fetch_add(1, std::memory_order_release);
+          task.signal(1);
+        }
+      });
+  // Abort every eighth task at a random moment, alternating between abort() and abort_async().
+  threads.emplace_back([&tasks](){
+      std::mt19937 rng(31);
+      for (int i = 0; i < number_of_tasks; i += 8)
+      {
+        std::this_thread::sleep_for(std::chrono::microseconds(rng() % 2000));
+        tasks[i]->m_aborted = true;
+        if (i % 16 == 0)
+          tasks[i]->abort();
+        else
+          tasks[i]->abort_async();
+      }
+    });
+  for (std::thread& thread : threads)
+    thread.join();
+
+  // Wait until every task called its call back (or give up after 10 seconds).
+  auto const start = std::chrono::steady_clock::now();
+  for (;;)
+  {
+    int done = 0;
+    for (auto& task : tasks)
+      if (task->m_callbacks > 0)
+        ++done;
+    if (done == number_of_tasks || std::chrono::steady_clock::now() - start > std::chrono::seconds(10))
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  AIAuxiliaryThread::stop();
+
+  int failures = 0;
+  int aborted = 0;
+  for (int i = 0; i < number_of_tasks; ++i)
+  {
+    Sink& task(*tasks[i]);
+    if (task.m_callbacks != 1)
+    {
+      std::cerr << "FAIL: the call back of task " << i << " was called " << task.m_callbacks << " times." << std::endl;
+      ++failures;
+    }
+    else if (!task.m_success)
+    {
+      ++aborted;
+      if (!task.m_aborted)
+      {
+        std::cerr << "FAIL: task " << i << " failed without being aborted." << std::endl;
+        ++failures;
+      }
+    }
+  }
+  if (failures)
+    return 1;
+  std::cout << "OK: " << number_of_tasks << " tasks, " << aborted << " aborted before they finished." << std::endl;
+  return 0;
+}
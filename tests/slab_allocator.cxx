@@ -0,0 +1,131 @@
+// Test and micro benchmark of AISlabAllocator and AISlabAllocated.
+//
+// Checks that blocks are reused when they are freed by the allocating thread, by another
+// thread and after the allocating thread exited, so that the memory obtained from the system
+// stays bounded; that blocks are aligned like std::max_align_t; and that objects of a derived
+// class fall back to the global operator new. Finally prints how long a new/delete pair
+// takes compared to the global operator new.
+
+#include "sys.h"
+#include "AISlabAllocator.h"
+#include "debug.h"
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Object : public AISlabAllocated<Object>
+{
+  char m_data[40];
+  virtual ~Object() { }
+};
+
+struct Derived : public Object
+{
+  char m_more[40];
+};
+
+struct Plain
+{
+  char m_data[40];
+  virtual ~Plain() { }
+};
+
+int const batch = 1000;
+
+bool aligned(void const* ptr)
+{
+  return reinterpret_cast<std::uintptr_t>(ptr) % alignof(std::max_align_t) == 0;
+}
+
+template<class T>
+double nanoseconds_per_pair()
+{
+  int const loops = 1000;
+  std::vector<T*> objects(batch);
+  auto const start = std::chrono::steady_clock::now();
+  for (int loop = 0; loop < loops; ++loop)
+  {
+    for (T*& object : objects)
+      object = new T;
+    for (T* object : objects)
+      delete object;
+  }
+  std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / (loops * batch);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // Allocate and free on the same thread: the second round must reuse the blocks of the first.
+  std::vector<Object*> objects(batch);
+  for (Object*& object : objects)
+  {
+    object = new Object;
+    if (!aligned(object))
+    {
+      std::cerr << "FAIL: " << (void*)object << " is not aligned like std::max_align_t." << std::endl;
+      return 1;
+    }
+  }
+  size_t const in_use = Object::memory_in_use();
+  for (Object* object : objects)
+    delete object;
+  for (Object*& object : objects)
+    object = new Object;
+  if (Object::memory_in_use() != in_use)
+  {
+    std::cerr << "FAIL: memory in use grew from " << in_use << " to " << Object::memory_in_use() << " bytes on reuse by the same thread." << std::endl;
+    return 1;
+  }
+
+  // Free the blocks on another thread; they must end up on the remote free list of this thread's cache.
+  std::thread([&objects](){ for (Object* object : objects) delete object; }).join();
+  for (Object*& object : objects)
+    object = new Object;
+  if (Object::memory_in_use() != in_use)
+  {
+    std::cerr << "FAIL: memory in use grew from " << in_use << " to " << Object::memory_in_use() << " bytes after freeing on another thread." << std::endl;
+    return 1;
+  }
+  for (Object* object : objects)
+    delete object;
+
+  // Short lived threads: each one must adopt the cache of the previous one.
+  for (int i = 0; i < 100; ++i)
+    std::thread([](){
+        std::vector<Object*> objects(batch);
+        for (Object*& object : objects)
+          object = new Object;
+        for (Object* object : objects)
+          delete object;
+      }).join();
+  // One cache for the main thread and one that is passed on from thread to thread.
+  if (Object::memory_in_use() > 2 * in_use)
+  {
+    std::cerr << "FAIL: memory in use grew from " << in_use << " to " << Object::memory_in_use() << " bytes after 100 short lived threads." << std::endl;
+    return 1;
+  }
+
+  // A derived class is larger than Object and must not use the slab allocator.
+  size_t const before = Object::memory_in_use();
+  for (int i = 0; i < batch; ++i)
+    delete new Derived;
+  if (Object::memory_in_use() != before)
+  {
+    std::cerr << "FAIL: objects of a derived class were allocated with the slab allocator." << std::endl;
+    return 1;
+  }
+
+  double const slab = nanoseconds_per_pair<Object>();
+  double const global = nanoseconds_per_pair<Plain>();
+  std::cout << "OK: new/delete takes " << slab << " ns with AISlabAllocated and " << global << " ns with the global operator new." << std::endl;
+  return 0;
+}
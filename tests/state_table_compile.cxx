@@ -0,0 +1,75 @@
+// Compile check for AIStateTable.h. The macro AI_STATE_TABLE is only expanded in the
+// class body of a task, so nothing in the library itself instantiates it. This declares
+// a table task and a table task that is derived from it, so that a change that breaks
+// either case is noticed by `make check' instead of by the first user.
+
+#include "sys.h"
+#include "AIStateTable.h"
+
+namespace {
+
+class FirstTask : public AIStatefulTask {
+  protected:
+    using direct_base_type = AIStatefulTask;
+    ~FirstTask() override { }
+
+    AI_STATE_TABLE(FirstTask, FirstTask_start, FirstTask_done);
+
+    static_assert(FirstTask_start == AIStatefulTask::max_state, "The first state must follow the states of the base class.");
+    static_assert(max_state == FirstTask_done + 1, "max_state must be one beyond the last state.");
+
+  public:
+    FirstTask() : AIStatefulTask(DEBUG_ONLY(false)) { }
+};
+
+void FirstTask::FirstTask_start_impl()
+{
+  set_state(FirstTask_done);
+  wait(1);
+}
+
+void FirstTask::FirstTask_done_impl()
+{
+  finish();
+}
+
+// A table task derived from a table task: its multiplex_impl() and state_str_impl()
+// pass the states of FirstTask on to FirstTask.
+class SecondTask : public FirstTask {
+  protected:
+    using direct_base_type = FirstTask;
+    ~SecondTask() override { }
+
+    AI_STATE_TABLE(SecondTask, SecondTask_start, SecondTask_done);
+
+    static_assert(SecondTask_start == FirstTask::max_state, "The first state must follow the states of the base class.");
+    static_assert(max_state == SecondTask_done + 1, "max_state must be one beyond the last state.");
+
+    void initialize_impl() override
+    {
+      set_state(SecondTask_start);
+    }
+
+  public:
+    SecondTask() { }
+};
+
+void SecondTask::SecondTask_start_impl()
+{
+  set_state(SecondTask_done);
+  wait(2);
+}
+
+void SecondTask::SecondTask_done_impl()
+{
+  // Continue with the states of the base class.
+  set_state(FirstTask_start);
+}
+
+} // namespace
+
+// Referenced, so that the compiler has to instantiate everything.
+AIStatefulTask* state_table_compile_check()
+{
+  return new SecondTask;
+}